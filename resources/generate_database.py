@@ -31,13 +31,21 @@ def animation_mirror(lrot, lpos, names, parents):
 
 """ Files to Process """
 
+# Tags are bit indices in the per-frame tag mask and
+# should match those in database.h
+
+TAG_IDLE = 0
+TAG_RUN = 1
+TAG_WALK = 2
+TAG_MIRRORED = 3
+
 files = [
     # We just use a small section of this clip for the standing idle
-    ('pushAndStumble1_subject5.bvh', 194,  351), 
+    ('pushAndStumble1_subject5.bvh', 194,  351, TAG_IDLE), 
     # Running
-    ('run1_subject5.bvh',             90, 7086),
+    ('run1_subject5.bvh',             90, 7086, TAG_RUN),
     # Walking
-    ('walk1_subject5.bvh',            80, 7791),
+    ('walk1_subject5.bvh',            80, 7791, TAG_WALK),
 ]
 
 """ We will accumulate data in these lists """
@@ -54,9 +62,11 @@ range_stops = []
 
 contact_states = []
 
+frame_tags = []
+
 """ Loop Over Files """
 
-for filename, start, stop in files:
+for filename, start, stop, tag in files:
     
     # For each file we process it mirrored and not mirrored
     for mirror in [False, True]:
@@ -188,6 +198,9 @@ for filename, start, stop in files:
         range_stops.append(offset + len(positions))
         
         contact_states.append(contacts)
+        
+        frame_tags.append(np.full(len(positions), 
+            (1 << tag) | ((1 << TAG_MIRRORED) if mirror else 0), dtype=np.uint64))
     
     
 """ Concatenate Data """
@@ -203,6 +216,8 @@ range_stops = np.array(range_stops).astype(np.int32)
 
 contact_states = np.concatenate(contact_states, axis=0).astype(np.uint8)
 
+frame_tags = np.concatenate(frame_tags, axis=0).astype(np.uint64)
+
 """ Visualize Stats """
 
 if True:
@@ -414,6 +429,8 @@ with open('database.bin', 'wb') as f:
     f.write(struct.pack('I', nranges) + range_stops.ravel().tobytes())
     
     f.write(struct.pack('II', nframes, ncontacts) + contact_states.ravel().tobytes())
+    
+    f.write(struct.pack('I', nframes) + frame_tags.ravel().tobytes())
 
     
     
\ No newline at end of file
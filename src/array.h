@@ -2,7 +2,11 @@
 
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #ifndef RESTRICT
 #ifdef _WIN32
@@ -12,6 +16,45 @@
 #endif // _WIN32
 #endif
 
+// All array storage is aligned to this many bytes (one cache 
+// line) so that rows padded to a multiple of the SIMD width 
+// can be read using aligned loads.
+#ifndef ARRAY_ALIGNMENT
+#define ARRAY_ALIGNMENT 64
+#endif
+
+static inline void* array_malloc(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, ARRAY_ALIGNMENT);
+#else
+    void* ptr = NULL;
+    return posix_memalign(&ptr, ARRAY_ALIGNMENT, size) == 0 ? ptr : NULL;
+#endif
+}
+
+static inline void* array_realloc(void* ptr, size_t old_size, size_t size)
+{
+#ifdef _WIN32
+    return _aligned_realloc(ptr, size, ARRAY_ALIGNMENT);
+#else
+    // There is no aligned realloc so allocate and copy
+    void* data = array_malloc(size);
+    if (data != NULL) { memcpy(data, ptr, old_size < size ? old_size : size); }
+    free(ptr);
+    return data;
+#endif
+}
+
+static inline void array_free(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 //--------------------------------------
 
 // Basic type representing a pointer to some
@@ -61,7 +104,10 @@ struct array1d
     int size;
     T* data;
     
-    array1d() : size(0), data(NULL) {}
+    // Data is not owned, e.g. points into a mapped file
+    bool mapped;
+    
+    array1d() : size(0), data(NULL), mapped(false) {}
     array1d(int _size) : array1d() { resize(_size);  }
     array1d(const slice1d<T>& rhs) : array1d() { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); }
     array1d(const array1d<T>& rhs) : array1d() { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); }
@@ -76,23 +122,49 @@ struct array1d
     void zero() { memset(data, 0, sizeof(T) * size); }
     void set(const T& x) { for (int i = 0; i < size; i++) { data[i] = x; } }
     
+    // Point at data owned by something else, which 
+    // must outlive the array or any call to `resize`
+    void map(T* _data, int _size)
+    {
+        resize(0);
+        if (_size > 0)
+        {
+            data = _data;
+            size = _size;
+            mapped = true;
+        }
+    }
+    
     void resize(int _size)
     {
+        // Mapped data is copied into owned storage when resized
+        if (mapped && _size != size)
+        {
+            T* old_data = data;
+            int old_size = size;
+            data = NULL;
+            size = 0;
+            mapped = false;
+            resize(_size);
+            if (_size > 0) { memcpy(data, old_data, (old_size < _size ? old_size : _size) * sizeof(T)); }
+            return;
+        }
+        
         if (_size == 0 && size != 0)
         {
-            free(data);
+            array_free(data);
             data = NULL;
             size = 0;
         }
         else if (_size > 0 && size == 0)
         {
-            data = (T*)malloc(_size * sizeof(T));
+            data = (T*)array_malloc(_size * sizeof(T));
             size = _size;
             assert(data != NULL);
         }
         else if (_size > 0 && size > 0 && _size != size)
         {
-            data = (T*)realloc(data, _size * sizeof(T));
+            data = (T*)array_realloc(data, size * sizeof(T), _size * sizeof(T));
             size = _size;
             assert(data != NULL);           
         }
@@ -124,7 +196,10 @@ struct array2d
     int rows, cols;
     T* data;
     
-    array2d() : rows(0), cols(0), data(NULL) {}
+    // Data is not owned, e.g. points into a mapped file
+    bool mapped;
+    
+    array2d() : rows(0), cols(0), data(NULL), mapped(false) {}
     array2d(int _rows, int _cols) : array2d() { resize(_rows, _cols);  }
     ~array2d() { resize(0, 0); }
 
@@ -138,28 +213,55 @@ struct array2d
     void zero() { memset(data, 0, sizeof(T) * rows * cols); }
     void set(const T& x) { for (int i = 0; i < rows * cols; i++) { data[i] = x; } }
 
+    // Point at data owned by something else, which 
+    // must outlive the array or any call to `resize`
+    void map(T* _data, int _rows, int _cols)
+    {
+        resize(0, 0);
+        if (_rows * _cols > 0)
+        {
+            data = _data;
+            rows = _rows;
+            cols = _cols;
+            mapped = true;
+        }
+    }
+
     void resize(int _rows, int _cols)
     {
         int _size = _rows * _cols;
         int size = rows * cols;
         
+        // Mapped data is copied into owned storage when resized
+        if (mapped && (_rows != rows || _cols != cols))
+        {
+            T* old_data = data;
+            data = NULL;
+            rows = 0;
+            cols = 0;
+            mapped = false;
+            resize(_rows, _cols);
+            if (_size > 0) { memcpy(data, old_data, (size < _size ? size : _size) * sizeof(T)); }
+            return;
+        }
+        
         if (_size == 0 && size != 0)
         {
-            free(data);
+            array_free(data);
             data = NULL;
             rows = 0;
             cols = 0;
         }
         else if (_size > 0 && size == 0)
         {
-            data = (T*)malloc(_size * sizeof(T));
+            data = (T*)array_malloc(_size * sizeof(T));
             rows = _rows;
             cols = _cols;
             assert(data != NULL);
         }
         else if (_size > 0 && size > 0 && _size != size)
         {
-            data = (T*)realloc(data, _size * sizeof(T));
+            data = (T*)array_realloc(data, size * sizeof(T), _size * sizeof(T));
             rows = _rows;
             cols = _cols;
             assert(data != NULL);           
@@ -1,5 +1,6 @@
 #include "mmpch.h"
 #include "character.h"
+#include "container.h"
 
 
 void character_load(character& c, const char* filename)
@@ -21,6 +22,49 @@ void character_load(character& c, const char* filename)
 	fclose(f);
 }
 
+bool character_save_container(const character& c, const char* filename)
+{
+	container_writer w;
+	if (!container_writer_open(w, filename)) { return false; }
+
+	container_write_array1d(w, "positions", c.positions);
+	container_write_array1d(w, "normals", c.normals);
+	container_write_array1d(w, "texcoords", c.texcoords);
+	container_write_array1d(w, "triangles", c.triangles);
+
+	container_write_array2d(w, "bone_weights", c.bone_weights);
+	container_write_array2d(w, "bone_indices", c.bone_indices);
+
+	container_write_array1d(w, "bone_rest_positions", c.bone_rest_positions);
+	container_write_array1d(w, "bone_rest_rotations", c.bone_rest_rotations);
+
+	return container_writer_close(w);
+}
+
+bool character_load_container(character& c, const char* filename, const bool verify)
+{
+	container file;
+	if (!container_open(file, filename)) { return false; }
+	if (verify && !container_verify(file)) { return false; }
+
+	return
+		container_read_array1d(c.positions, file, "positions") &&
+		container_read_array1d(c.normals, file, "normals") &&
+		container_read_array1d(c.texcoords, file, "texcoords") &&
+		container_read_array1d(c.triangles, file, "triangles") &&
+		container_read_array2d(c.bone_weights, file, "bone_weights") &&
+		container_read_array2d(c.bone_indices, file, "bone_indices") &&
+		container_read_array1d(c.bone_rest_positions, file, "bone_rest_positions") &&
+		container_read_array1d(c.bone_rest_rotations, file, "bone_rest_rotations");
+}
+
+bool character_convert_container(const char* character_filename, const char* filename)
+{
+	character c;
+	character_load(c, character_filename);
+	return character_save_container(c, filename);
+}
+
 //--------------------------------------
 
 void linear_blend_skinning_positions(
@@ -49,6 +49,16 @@ struct character
 
 void character_load(character& c, const char* filename);
 
+// Save or load the character as a container (see `container.h`).
+// Saving returns false if the file could not be written. Loading
+// returns false if the file cannot be opened or a chunk is 
+// missing, or if `verify` is set and a checksum does not match.
+bool character_save_container(const character& c, const char* filename);
+bool character_load_container(character& c, const char* filename, const bool verify = false);
+
+// Convert a character in the original format to a container
+bool character_convert_container(const char* character_filename, const char* filename);
+
 //--------------------------------------
 
 void linear_blend_skinning_positions(
@@ -0,0 +1,150 @@
+#include "mmpch.h"
+#include "container.h"
+
+bool container_open(container& c, const char* filename)
+{
+	c.chunks.clear();
+
+	mapped_file file;
+	if (!mapped_file_open(file, filename)) { return false; }
+
+	container_header header;
+	if (file.size < sizeof(container_header)) { return false; }
+	memcpy(&header, file.data, sizeof(container_header));
+
+	if (header.magic != CONTAINER_MAGIC ||
+		header.version != CONTAINER_VERSION ||
+		header.byte_order != CONTAINER_BYTE_ORDER)
+	{
+		return false;
+	}
+
+	// Contents are written last so a truncated file will be
+	// missing them, or will have chunks extending past the end
+	if (header.contents_offset > file.size ||
+		header.nchunks > (file.size - header.contents_offset) / sizeof(container_chunk))
+	{
+		return false;
+	}
+
+	std::vector<container_chunk> chunks(header.nchunks);
+	memcpy(chunks.data(), file.data + header.contents_offset, header.nchunks * sizeof(container_chunk));
+
+	for (const container_chunk& chunk : chunks)
+	{
+		if (chunk.name[CONTAINER_NAME_SIZE - 1] != '\0' ||
+			chunk.offset % ARRAY_ALIGNMENT != 0 ||
+			chunk.rows < 0 || chunk.cols < 0 ||
+			chunk.size != (uint64_t)chunk.rows * chunk.cols * chunk.type_size ||
+			chunk.offset > header.contents_offset ||
+			chunk.size > header.contents_offset - chunk.offset)
+		{
+			return false;
+		}
+	}
+
+	mapped_file_swap(c.file, file);
+	c.chunks = chunks;
+
+	return true;
+}
+
+const container_chunk* container_find(const container& c, const char* name)
+{
+	for (const container_chunk& chunk : c.chunks)
+	{
+		if (strcmp(chunk.name, name) == 0)
+		{
+			return &chunk;
+		}
+	}
+
+	return nullptr;
+}
+
+bool container_verify_chunk(const container& c, const container_chunk& chunk)
+{
+	return container_hash_bytes(CONTAINER_HASH_BASIS, c.file.data + chunk.offset, (size_t)chunk.size) == chunk.checksum;
+}
+
+bool container_verify(const container& c)
+{
+	for (const container_chunk& chunk : c.chunks)
+	{
+		if (!container_verify_chunk(c, chunk))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//--------------------------------------
+
+bool container_writer_open(container_writer& w, const char* filename)
+{
+	w.file = mapped_file_create(filename);
+	if (w.file == NULL) { return false; }
+	snprintf(w.filename, sizeof(w.filename), "%s", filename);
+	w.chunks.clear();
+
+	// Header is written again once the contents are known
+	container_header header;
+	memset(&header, 0, sizeof(container_header));
+	fwrite(&header, sizeof(container_header), 1, w.file);
+
+	return true;
+}
+
+bool container_writer_close(container_writer& w)
+{
+	mapped_file_write_padding(w.file);
+
+	container_header header;
+	header.magic = CONTAINER_MAGIC;
+	header.version = CONTAINER_VERSION;
+	header.byte_order = CONTAINER_BYTE_ORDER;
+	header.nchunks = (uint32_t)w.chunks.size();
+	header.contents_offset = (uint64_t)ftell(w.file);
+
+	fwrite(w.chunks.data(), sizeof(container_chunk), w.chunks.size(), w.file);
+
+	fseek(w.file, 0, SEEK_SET);
+	fwrite(&header, sizeof(container_header), 1, w.file);
+
+	bool written = mapped_file_commit(w.file, w.filename);
+	w.file = NULL;
+	w.chunks.clear();
+
+	return written;
+}
+
+void container_write_chunk(
+	container_writer& w,
+	const char* name,
+	const void* data,
+	const uint32_t type_size,
+	const int rows,
+	const int cols)
+{
+	assert(w.file != NULL);
+	assert(strlen(name) < CONTAINER_NAME_SIZE);
+
+	mapped_file_write_padding(w.file);
+
+	container_chunk chunk;
+	memset(&chunk, 0, sizeof(container_chunk));
+	strcpy(chunk.name, name);
+	chunk.type_size = type_size;
+	chunk.rows = rows;
+	chunk.cols = cols;
+	chunk.offset = (uint64_t)ftell(w.file);
+	chunk.size = (uint64_t)rows * cols * type_size;
+	chunk.checksum = container_hash_bytes(CONTAINER_HASH_BASIS, data, (size_t)chunk.size);
+
+	size_t num = fwrite(data, 1, (size_t)chunk.size, w.file);
+	assert(num == chunk.size);
+
+	w.chunks.push_back(chunk);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "mmpch.h"
+#include "mapped_file.h"
+
+#include <vector>
+
+//--------------------------------------
+
+// Chunked binary container used for the database, features,
+// character and networks. The layout is:
+//
+//   header    magic, version, byte order mark, chunk count
+//             and the offset of the table of contents
+//   chunks    raw array data, each starting at a multiple
+//             of ARRAY_ALIGNMENT from the start of the file
+//   contents  one `container_chunk` per chunk
+//
+// Files are mapped when opened so only the chunks which are
+// actually read or mapped are ever loaded from disk.
+
+enum
+{
+    CONTAINER_MAGIC = 0x46434d4d, // "MMCF"
+    CONTAINER_VERSION = 1,
+    CONTAINER_BYTE_ORDER = 0x01020304,
+    CONTAINER_NAME_SIZE = 48,
+};
+
+struct container_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t nchunks;
+    uint64_t contents_offset;
+};
+
+// One-dimensional arrays are stored with a single column
+struct container_chunk
+{
+    char name[CONTAINER_NAME_SIZE];
+    uint32_t type_size;
+    int32_t rows;
+    int32_t cols;
+    uint32_t padding;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+struct container
+{
+    mapped_file file;
+    std::vector<container_chunk> chunks;
+};
+
+// Returns false if the file does not exist, is not a container,
+// has a different version or byte order, or is truncated. Chunk
+// data is not read or checked here, see `container_verify`.
+bool container_open(container& c, const char* filename);
+
+// Returns nullptr if there is no chunk with this name
+const container_chunk* container_find(const container& c, const char* name);
+
+// Check the checksum of every chunk, which reads the whole file
+bool container_verify(const container& c);
+
+// Check the checksum of a single chunk
+bool container_verify_chunk(const container& c, const container_chunk& chunk);
+
+//--------------------------------------
+
+// FNV-1a over some bytes, continuing from `hash`, which should
+// start as CONTAINER_HASH_BASIS. Used for the chunk checksums and
+// also for hashing the source files of cached data.
+
+static const uint64_t CONTAINER_HASH_BASIS = 14695981039346656037ull;
+
+static inline uint64_t container_hash_bytes(uint64_t hash, const void* data, const size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+//--------------------------------------
+
+static inline const container_chunk* container_find_typed(
+    const container& c,
+    const char* name,
+    const size_t type_size)
+{
+    const container_chunk* chunk = container_find(c, name);
+    return chunk != nullptr && chunk->type_size == type_size ? chunk : nullptr;
+}
+
+// Copy a chunk into an array, returning false if it is missing
+template<typename T>
+bool container_read_array1d(array1d<T>& arr, const container& c, const char* name)
+{
+    const container_chunk* chunk = container_find_typed(c, name, sizeof(T));
+    if (chunk == nullptr) { return false; }
+    arr.resize(chunk->rows * chunk->cols);
+    memcpy(arr.data, c.file.data + chunk->offset, (size_t)chunk->size);
+    return true;
+}
+
+template<typename T>
+bool container_read_array2d(array2d<T>& arr, const container& c, const char* name)
+{
+    const container_chunk* chunk = container_find_typed(c, name, sizeof(T));
+    if (chunk == nullptr) { return false; }
+    arr.resize(chunk->rows, chunk->cols);
+    memcpy(arr.data, c.file.data + chunk->offset, (size_t)chunk->size);
+    return true;
+}
+
+// Point an array straight at a chunk. The mapping of the
+// container must then be kept for as long as the array.
+template<typename T>
+bool container_map_array1d(array1d<T>& arr, const container& c, const char* name)
+{
+    const container_chunk* chunk = container_find_typed(c, name, sizeof(T));
+    if (chunk == nullptr) { return false; }
+    arr.map((T*)(c.file.data + chunk->offset), chunk->rows * chunk->cols);
+    return true;
+}
+
+template<typename T>
+bool container_map_array2d(array2d<T>& arr, const container& c, const char* name)
+{
+    const container_chunk* chunk = container_find_typed(c, name, sizeof(T));
+    if (chunk == nullptr) { return false; }
+    arr.map((T*)(c.file.data + chunk->offset), chunk->rows, chunk->cols);
+    return true;
+}
+
+//--------------------------------------
+
+// Written through `mapped_file_create` so the container only
+// replaces `filename` once it is complete
+struct container_writer
+{
+    FILE* file = NULL;
+    char filename[512];
+    std::vector<container_chunk> chunks;
+};
+
+// Returns false if the file cannot be created
+bool container_writer_open(container_writer& w, const char* filename);
+
+// Write the table of contents, close the file and rename it. 
+// Returns false, leaving any existing file as it was, if 
+// anything failed to be written.
+bool container_writer_close(container_writer& w);
+
+void container_write_chunk(
+    container_writer& w,
+    const char* name,
+    const void* data,
+    const uint32_t type_size,
+    const int rows,
+    const int cols);
+
+template<typename T>
+void container_write_array1d(container_writer& w, const char* name, const array1d<T>& arr)
+{
+    container_write_chunk(w, name, arr.data, sizeof(T), arr.size, 1);
+}
+
+template<typename T>
+void container_write_array2d(container_writer& w, const char* name, const array2d<T>& arr)
+{
+    container_write_chunk(w, name, arr.data, sizeof(T), arr.rows, arr.cols);
+}
@@ -789,6 +789,25 @@ int main(void)
 	Model ground_plane_model = LoadModelFromMesh(ground_plane_mesh);
 	ground_plane_model.materials[0].shader = ground_plane_shader;
 
+	// Optionally convert the resources to containers which can
+	// then be loaded with the `*_load_container` functions
+
+	bool convert_containers = false;
+	if (convert_containers)
+	{
+		bool converted = 
+			character_convert_container("./resources/character.bin", "./resources/character.container") &&
+			database_convert_container("./resources/database.bin", "./resources/database.container") &&
+			nnet_convert_container("./resources/decompressor.bin", "./resources/decompressor.container") &&
+			nnet_convert_container("./resources/stepper.bin", "./resources/stepper.container") &&
+			nnet_convert_container("./resources/projector.bin", "./resources/projector.container");
+
+		if (!converted)
+		{
+			TraceLog(LOG_WARNING, "Failed to convert resources to containers");
+		}
+	}
+
 	// Character
 
 	character character_data;
@@ -801,8 +820,23 @@ int main(void)
 
 	// Load Animation Data and build Matching Database
 
+	// The database is mapped from an aligned copy which is written
+	// the first time it is loaded and whenever it changes
+
 	database db;
-	database_load(db, "./resources/database.bin");
+	if (!database_load_mapped(db, "./resources/database_mapped.bin", "./resources/database.bin"))
+	{
+		database_load(db, "./resources/database.bin");
+		if (!database_save_mapped(db, "./resources/database_mapped.bin", "./resources/database.bin"))
+		{
+			TraceLog(LOG_WARNING, "Failed to save mapped database, it will be loaded again next run");
+		}
+	}
+
+	// Number of threads used by the database build and search
+	int search_threads = 1;
+	thread_pool search_pool;
+	thread_pool_resize(search_pool, search_threads);
 
 	float feature_weight_foot_position = 0.75f;
 	float feature_weight_foot_velocity = 1.0f;
@@ -810,7 +844,10 @@ int main(void)
 	float feature_weight_trajectory_positions = 1.0f;
 	float feature_weight_trajectory_directions = 1.5f;
 
-	database_build_matching_features(
+	// Features are only rebuilt when the database, weights or
+	// feature schema have changed since they were last saved
+
+	uint64_t features_hash = database_features_hash(
 		db,
 		feature_weight_foot_position,
 		feature_weight_foot_velocity,
@@ -818,7 +855,55 @@ int main(void)
 		feature_weight_trajectory_positions,
 		feature_weight_trajectory_directions);
 
-	database_save_matching_features(db, "./resources/features.bin");
+	if (!database_load_matching_features(db, "./resources/features.bin", features_hash))
+	{
+		database_build_matching_features(
+			db,
+			feature_weight_foot_position,
+			feature_weight_foot_velocity,
+			feature_weight_hip_velocity,
+			feature_weight_trajectory_positions,
+			feature_weight_trajectory_directions,
+			&search_pool);
+
+		if (!database_save_matching_features(db, "./resources/features.bin", features_hash))
+		{
+			TraceLog(LOG_WARNING, "Failed to save features cache, features will be rebuilt next run");
+		}
+	}
+
+	// Optional approximate search for large databases
+
+	bool hnsw_enabled = false;
+	hnsw search_graph;
+	hnsw_evaluation search_graph_evaluation;
+	float search_graph_recall = 0.0f;
+	float search_graph_exact_time = 0.0f;
+	float search_graph_approx_time = 0.0f;
+
+	if (hnsw_enabled)
+	{
+		// The graph is built from the search features so 
+		// depends on exactly the same things
+		if (!hnsw_load(search_graph, "./resources/hnsw.bin", features_hash))
+		{
+			hnsw_build(search_graph, db);
+			if (!hnsw_save(search_graph, "./resources/hnsw.bin", features_hash))
+			{
+				TraceLog(LOG_WARNING, "Failed to save search graph, it will be rebuilt next run");
+			}
+		}
+
+		search_graph_evaluation.resize(search_graph, db);
+
+		hnsw_recall(
+			search_graph_recall,
+			search_graph_exact_time,
+			search_graph_approx_time,
+			search_graph_evaluation,
+			search_graph,
+			db);
+	}
 
 	// Pose & Inertializer Data
 
@@ -896,6 +981,12 @@ int main(void)
 	float search_timer = search_time;
 	float force_search_timer = search_time;
 
+	// Optionally spread each search over several frames, 
+	// searching at most this many large boxes per frame
+	bool search_sliced = false;
+	int search_slice_boxes = 64;
+	search_state search_slice;
+
 	vec3 desired_velocity;
 	vec3 desired_velocity_change_curr;
 	vec3 desired_velocity_change_prev;
@@ -971,6 +1062,90 @@ int main(void)
 	stepper_evaluation.resize(stepper);
 	projector_evaluation.resize(projector);
 
+	// Optional benchmark of the layers of each network with the 
+	// packed weights against `nnet_layer_linear`, using the input
+	// of a frame replayed from the database
+
+	bool lmm_benchmark = false;
+	float lmm_gflops_reference[3] = { 0.0f, 0.0f, 0.0f };
+	float lmm_gflops_packed[3] = { 0.0f, 0.0f, 0.0f };
+
+	if (lmm_benchmark)
+	{
+		array2d<float> projector_inputs(1, projector_evaluation.layers.front().size);
+		array2d<float> lmm_inputs(1, projector_evaluation.layers.back().size);
+
+		projector_replay(
+			projector_inputs,
+			lmm_inputs,
+			projector_evaluation,
+			db.features,
+			db.features_offset,
+			db.features_scale,
+			projector);
+
+		const nnet* networks[3] = { &decompressor, &stepper, &projector };
+		nnet_evaluation* evaluations[3] = { &decompressor_evaluation, &stepper_evaluation, &projector_evaluation };
+		slice1d<float> inputs[3] = { lmm_inputs(0), lmm_inputs(0), projector_inputs(0) };
+
+		for (int n = 0; n < 3; n++)
+		{
+			const nnet& nn = *networks[n];
+			int nlayers = (int)nn.weights.size();
+
+			array1d<float> gflops_reference(nlayers);
+			array1d<float> gflops_packed(nlayers);
+
+			evaluations[n]->layers.front() = inputs[n];
+			nnet_benchmark(gflops_reference, gflops_packed, *evaluations[n], nn);
+
+			// Speed of the whole network from the speed of each layer
+			float flops = 0.0f, time_reference = 0.0f, time_packed = 0.0f;
+			for (int l = 0; l < nlayers; l++)
+			{
+				float layer_flops = (float)nn.weights[l].rows * nn.weights[l].cols;
+				flops += layer_flops;
+				time_reference += layer_flops / gflops_reference(l);
+				time_packed += layer_flops / gflops_packed(l);
+			}
+
+			lmm_gflops_reference[n] = flops / time_reference;
+			lmm_gflops_packed[n] = flops / time_packed;
+		}
+	}
+
+	// Optional int8 weights. The accuracy of each network is checked
+	// on frames of the database replayed through the float projector,
+	// whose outputs are the inputs of the decompressor and stepper.
+
+	bool lmm_quantized = false;
+	float lmm_quantized_mean_error[3] = { 0.0f, 0.0f, 0.0f };
+	float lmm_quantized_max_error[3] = { 0.0f, 0.0f, 0.0f };
+
+	if (lmm_quantized)
+	{
+		int nreplay = std::min(db.nframes(), 1000);
+		array2d<float> projector_inputs(nreplay, projector_evaluation.layers.front().size);
+		array2d<float> lmm_inputs(nreplay, projector_evaluation.layers.back().size);
+
+		projector_replay(
+			projector_inputs,
+			lmm_inputs,
+			projector_evaluation,
+			db.features,
+			db.features_offset,
+			db.features_scale,
+			projector);
+
+		nnet_quantize(decompressor);
+		nnet_quantize(stepper);
+		nnet_quantize(projector);
+
+		nnet_quantized_error(lmm_quantized_mean_error[0], lmm_quantized_max_error[0], decompressor_evaluation, decompressor, lmm_inputs);
+		nnet_quantized_error(lmm_quantized_mean_error[1], lmm_quantized_max_error[1], stepper_evaluation, stepper, lmm_inputs);
+		nnet_quantized_error(lmm_quantized_mean_error[2], lmm_quantized_max_error[2], projector_evaluation, projector, projector_inputs);
+	}
+
 	array1d<float> features_proj = db.features(frame_index);
 	array1d<float> features_curr = db.features(frame_index);
 	array1d<float> latent_proj(32); latent_proj.zero();
@@ -1116,10 +1291,13 @@ int main(void)
 		bool end_of_anim = database_trajectory_index_clamp(db, frame_index, 1) == frame_index;
 
 		// Do we need to search?
-		if (force_search || search_timer <= 0.0f || end_of_anim)
+		if (force_search || search_timer <= 0.0f || end_of_anim || search_slice.active)
 		{
 			if (lmm_enabled)
 			{
+				// Drop any search which was in progress
+				search_slice.active = false;
+
 				// Project query onto nearest feature vector
 
 				float best_cost = FLT_MAX;
@@ -1189,12 +1367,48 @@ int main(void)
 
 				int best_index = end_of_anim ? -1 : frame_index;
 				float best_cost = FLT_MAX;
+				bool search_done = true;
 
-				database_search(
-					best_index,
-					best_cost,
-					db,
-					query);
+				if (search_sliced)
+				{
+					// Restart if forced since the query may have changed a lot
+					if (!search_slice.active || force_search || end_of_anim)
+					{
+						database_search_sliced_begin(search_slice, db, query, best_index);
+					}
+
+					if (force_search || end_of_anim)
+					{
+						database_search_sliced_finish(search_slice, db);
+					}
+					else
+					{
+						search_done = database_search_sliced_step(search_slice, db, search_slice_boxes);
+					}
+
+					// Only transition if better than the frame we searched from
+					best_index = search_done && search_slice.best_index != search_slice.curr_index ? 
+						search_slice.best_index : frame_index;
+				}
+				else if (hnsw_enabled)
+				{
+					hnsw_search(
+						best_index,
+						best_cost,
+						search_graph_evaluation,
+						search_graph,
+						db,
+						query);
+				}
+				else
+				{
+					database_search_parallel(
+						best_index,
+						best_cost,
+						search_pool,
+						db,
+						query);
+				}
 
 				// Transition if better frame found
 
@@ -1232,7 +1446,10 @@ int main(void)
 			}
 
 			// Reset search timer
-			search_timer = search_time;
+			if (!search_slice.active)
+			{
+				search_timer = search_time;
+			}
 		}
 
 		// Tick down search timer
@@ -1642,11 +1859,78 @@ int main(void)
 		GuiLabel(Rectangle{ 1030, ui_ctrl_hei + 90, 200, 20 }, "Right Shoulder - Zoom Out");
 		GuiLabel(Rectangle{ 1030, ui_ctrl_hei + 110, 200, 20 }, "A Button - Walk");
 
+		//---------
+
+		if (hnsw_enabled)
+		{
+			float ui_hnsw_hei = 530;
 
+			GuiGroupBox(Rectangle{ 970, ui_hnsw_hei, 290, 70 }, "approximate search");
+
+			GuiLabel(Rectangle{ 1000, ui_hnsw_hei + 10, 250, 20 }, TextFormat(
+				"recall %4.2f exact %5.1fus graph %5.1fus",
+				search_graph_recall,
+				search_graph_exact_time,
+				search_graph_approx_time));
+
+			// Weights changed by the sliders are not reflected
+			// in the graph until the database is rebuilt
+			if (GuiButton(Rectangle{ 1100, ui_hnsw_hei + 40, 120, 20 }, "check recall"))
+			{
+				hnsw_recall(
+					search_graph_recall,
+					search_graph_exact_time,
+					search_graph_approx_time,
+					search_graph_evaluation,
+					search_graph,
+					db);
+			}
+		}
 
 		//---------
 
-		GuiGroupBox(Rectangle{ 20, 20, 290, 190 }, "feature weights");
+		if (lmm_quantized || lmm_benchmark)
+		{
+			float ui_nnet_hei = 610;
+
+			GuiGroupBox(Rectangle{ 970, ui_nnet_hei, 290, 100 }, "networks");
+
+			const char* nnet_names[3] = { "decompressor", "stepper", "projector" };
+
+			if (lmm_quantized) { GuiLabel(Rectangle{ 1070, ui_nnet_hei + 10, 90, 20 }, "int8 mean / max"); }
+			if (lmm_benchmark) { GuiLabel(Rectangle{ 1170, ui_nnet_hei + 10, 80, 20 }, "GFLOP/s packed"); }
+
+			for (int n = 0; n < 3; n++)
+			{
+				GuiLabel(Rectangle{ 990, ui_nnet_hei + 30 + 20 * n, 80, 20 }, nnet_names[n]);
+
+				if (lmm_quantized)
+				{
+					GuiLabel(Rectangle{ 1070, ui_nnet_hei + 30 + 20 * n, 90, 20 }, TextFormat(
+						"%5.3f / %5.3f",
+						lmm_quantized_mean_error[n],
+						lmm_quantized_max_error[n]));
+				}
+
+				if (lmm_benchmark)
+				{
+					GuiLabel(Rectangle{ 1170, ui_nnet_hei + 30 + 20 * n, 80, 20 }, TextFormat(
+						"%4.1f -> %4.1f",
+						lmm_gflops_reference[n],
+						lmm_gflops_packed[n]));
+				}
+			}
+		}
+
+		//---------
+
+		GuiGroupBox(Rectangle{ 20, 20, 290, 220 }, "feature weights");
+
+		float feature_weight_foot_position_prev = feature_weight_foot_position;
+		float feature_weight_foot_velocity_prev = feature_weight_foot_velocity;
+		float feature_weight_hip_velocity_prev = feature_weight_hip_velocity;
+		float feature_weight_trajectory_positions_prev = feature_weight_trajectory_positions;
+		float feature_weight_trajectory_directions_prev = feature_weight_trajectory_directions;
 
 		feature_weight_foot_position = GuiSliderBar(
 			Rectangle{ 150, 30, 120, 20 },
@@ -1678,7 +1962,40 @@ int main(void)
 			TextFormat("%5.3f", feature_weight_trajectory_directions),
 			feature_weight_trajectory_directions, 0.001f, 3.0f);
 
-		if (GuiButton(Rectangle{ 150, 180, 120, 20 }, "rebuild database"))
+		// Changing the weights only rescales the existing features
+		// so can be done as the sliders move. A full rebuild also
+		// re-sorts the search dimensions and rebuilds the KD-tree 
+		// and graph for the new weights.
+		if (feature_weight_foot_position != feature_weight_foot_position_prev ||
+			feature_weight_foot_velocity != feature_weight_foot_velocity_prev ||
+			feature_weight_hip_velocity != feature_weight_hip_velocity_prev ||
+			feature_weight_trajectory_positions != feature_weight_trajectory_positions_prev ||
+			feature_weight_trajectory_directions != feature_weight_trajectory_directions_prev)
+		{
+			database_set_feature_weights(
+				db,
+				feature_weight_foot_position,
+				feature_weight_foot_velocity,
+				feature_weight_hip_velocity,
+				feature_weight_trajectory_positions,
+				feature_weight_trajectory_directions,
+				&search_pool);
+		}
+
+		int search_threads_prev = search_threads;
+
+		search_threads = (int)roundf(GuiSliderBar(
+			Rectangle{ 150, 180, 120, 20 },
+			"search threads",
+			TextFormat("%d", search_threads),
+			(float)search_threads, 1.0f, 16.0f));
+
+		if (search_threads != search_threads_prev)
+		{
+			thread_pool_resize(search_pool, search_threads);
+		}
+
+		if (GuiButton(Rectangle{ 150, 210, 120, 20 }, "rebuild database"))
 		{
 			database_build_matching_features(
 				db,
@@ -1686,12 +2003,26 @@ int main(void)
 				feature_weight_foot_velocity,
 				feature_weight_hip_velocity,
 				feature_weight_trajectory_positions,
-				feature_weight_trajectory_directions);
+				feature_weight_trajectory_directions,
+				&search_pool);
+
+			if (hnsw_enabled)
+			{
+				hnsw_build(search_graph, db);
+
+				hnsw_recall(
+					search_graph_recall,
+					search_graph_exact_time,
+					search_graph_approx_time,
+					search_graph_evaluation,
+					search_graph,
+					db);
+			}
 		}
 
 		//---------
 
-		float ui_sync_hei = 220;
+		float ui_sync_hei = 250;
 
 		GuiGroupBox(Rectangle{ 20, ui_sync_hei, 290, 70 }, "synchronization");
 
@@ -1708,7 +2039,7 @@ int main(void)
 
 		//---------
 
-		float ui_adj_hei = 300;
+		float ui_adj_hei = 330;
 
 		GuiGroupBox(Rectangle{ 20, ui_adj_hei, 290, 130 }, "adjustment");
 
@@ -1736,7 +2067,7 @@ int main(void)
 
 		//---------
 
-		float ui_clamp_hei = 440;
+		float ui_clamp_hei = 470;
 
 		GuiGroupBox(Rectangle{ 20, ui_clamp_hei, 290, 100 }, "clamping");
 
@@ -1759,7 +2090,7 @@ int main(void)
 
 		//---------
 
-		float ui_ik_hei = 550;
+		float ui_ik_hei = 580;
 
 		GuiGroupBox(Rectangle{ 20, ui_ik_hei, 290, 100 }, "inverse kinematics");
 
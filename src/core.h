@@ -4,6 +4,7 @@
 #include "gamepad.h"
 #include "character.h"
 #include "database.h"
+#include "hnsw.h"
 #include "nnet.h"
 #include "lmm.h"
 #include "ik_contact.h"
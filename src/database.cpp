@@ -1,6 +1,63 @@
 #include "mmpch.h"
 #include "database.h"
 #include "character.h"
+#include "search_kernel.h"
+#include "thread_pool.h"
+#include "mapped_file.h"
+#include "container.h"
+
+#include <chrono>
+#include <sys/stat.h>
+
+// Runs `func(chunk, start, stop)` for each chunk of BUILD_CHUNK_SIZE
+// frames, in parallel when given a pool. Chunks do not depend on the
+// number of threads, so reductions done per chunk and then combined
+// in chunk order always give the same result.
+static void database_build_chunks(
+	thread_pool* pool,
+	const int nframes,
+	const std::function<void(int, int, int)>& func)
+{
+	int nchunks = (nframes + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE;
+
+	auto chunk_func = [&](int chunk, int)
+	{
+		int start = chunk * BUILD_CHUNK_SIZE;
+		int stop = start + BUILD_CHUNK_SIZE < nframes ? start + BUILD_CHUNK_SIZE : nframes;
+		func(chunk, start, stop);
+	};
+
+	if (pool)
+	{
+		thread_pool_run(*pool, nchunks, chunk_func);
+	}
+	else
+	{
+		for (int chunk = 0; chunk < nchunks; chunk++)
+		{
+			chunk_func(chunk, 0);
+		}
+	}
+}
+
+static uint64_t database_file_hash(const char* filename)
+{
+	uint64_t hash = CONTAINER_HASH_BASIS;
+
+	FILE* f = fopen(filename, "rb");
+	assert(f != NULL);
+
+	unsigned char buffer[65536];
+	size_t num;
+	while ((num = fread(buffer, 1, sizeof(buffer), f)) > 0)
+	{
+		hash = container_hash_bytes(hash, buffer, num);
+	}
+
+	fclose(f);
+
+	return hash;
+}
 
 void database_load(database& db, const char* filename)
 {
@@ -18,36 +75,486 @@ void database_load(database& db, const char* filename)
 
 	array2d_read(db.contact_states, f);
 
+	database_build_range_index(db);
+
+	// Tags are optional as they were added to the format later
+	int ntags = 0;
+	if (fread(&ntags, sizeof(int), 1, f) == 1)
+	{
+		db.frame_tags.resize(ntags);
+		size_t num = fread(db.frame_tags.data, sizeof(uint64_t), ntags, f);
+		assert((int)num == ntags && ntags == db.nframes());
+	}
+	else
+	{
+		db.frame_tags.resize(db.nframes());
+		db.frame_tags.zero();
+	}
+
 	fclose(f);
+
+	db.hash = database_file_hash(filename);
 }
 
-void database_save_matching_features(const database& db, const char* filename)
+// Header of the mapped database file. The size and modification
+// time of the source file are used to check it has not changed
+// since the mapped file was written without having to read it.
+struct database_mapped_header
 {
-	FILE* f = fopen(filename, "wb");
-	assert(f != NULL);
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_time;
+	uint64_t source_hash;
+};
+
+static const uint32_t DATABASE_MAPPED_MAGIC = 0x42444d4d; // "MMDB"
+
+static bool database_source_stat(uint64_t& size, int64_t& time, const char* source_filename)
+{
+	struct stat st;
+	if (stat(source_filename, &st) != 0) { return false; }
+	size = (uint64_t)st.st_size;
+	time = (int64_t)st.st_mtime;
+	return true;
+}
+
+// Overloads so the arrays of the mapped files can be listed once
+// and then written, mapped or cleared in the same order
+
+template<typename T>
+static void database_mapped_write(const array1d<T>& arr, FILE* f) { mapped_file_write_array1d(arr, f); }
+template<typename T>
+static void database_mapped_write(const array2d<T>& arr, FILE* f) { mapped_file_write_array2d(arr, f); }
+
+template<typename T>
+static bool database_mapped_read(array1d<T>& arr, const mapped_file& file, size_t& offset) { return mapped_file_read_array1d(arr, file, offset); }
+template<typename T>
+static bool database_mapped_read(array2d<T>& arr, const mapped_file& file, size_t& offset) { return mapped_file_read_array2d(arr, file, offset); }
+
+// Mapped arrays must be cleared before the mapping is closed
+template<typename T>
+static void database_mapped_clear(array1d<T>& arr) { arr.resize(0); }
+template<typename T>
+static void database_mapped_clear(array2d<T>& arr) { arr.resize(0, 0); }
+
+// Calls `f` on every array stored in the mapped database
+template<typename D, typename F>
+static void database_mapped_arrays(D& db, F&& f)
+{
+	f(db.bone_positions);
+	f(db.bone_velocities);
+	f(db.bone_rotations);
+	f(db.bone_angular_velocities);
+	f(db.bone_parents);
+
+	f(db.range_starts);
+	f(db.range_stops);
+	f(db.range_index);
+
+	f(db.contact_states);
+	f(db.frame_tags);
+}
+
+bool database_save_mapped(const database& db, const char* filename, const char* source_filename)
+{
+	database_mapped_header header;
+	memset(&header, 0, sizeof(database_mapped_header));
+	header.magic = DATABASE_MAPPED_MAGIC;
+	header.version = DATABASE_MAPPED_VERSION;
+	header.source_hash = db.hash;
+	if (!database_source_stat(header.source_size, header.source_time, source_filename)) { return false; }
+
+	FILE* f = mapped_file_create(filename);
+	if (f == NULL) { return false; }
+
+	fwrite(&header, sizeof(database_mapped_header), 1, f);
+
+	database_mapped_arrays(db, [&](const auto& arr) { database_mapped_write(arr, f); });
+
+	return mapped_file_commit(f, filename);
+}
+
+bool database_load_mapped(database& db, const char* filename, const char* source_filename)
+{
+	mapped_file file;
+	if (!mapped_file_open(file, filename)) { return false; }
+
+	uint64_t source_size = 0;
+	int64_t source_time = 0;
+	if (!database_source_stat(source_size, source_time, source_filename)) { return false; }
+
+	database_mapped_header header;
+	size_t offset = 0;
+	if (!mapped_file_read(&header, sizeof(database_mapped_header), file, offset)) { return false; }
+
+	if (header.magic != DATABASE_MAPPED_MAGIC ||
+		header.version != DATABASE_MAPPED_VERSION ||
+		header.source_size != source_size ||
+		header.source_time != source_time)
+	{
+		return false;
+	}
+
+	bool found = true;
+	database_mapped_arrays(db, [&](auto& arr) { found = found && database_mapped_read(arr, file, offset); });
+
+	if (!found)
+	{
+		database_mapped_arrays(db, [](auto& arr) { database_mapped_clear(arr); });
+		return false;
+	}
+
+	// Arrays now point into the new mapping so the old one can go
+	mapped_file_swap(db.mapping, file);
+
+	db.hash = header.source_hash;
+
+	return true;
+}
+
+// Calls `f` on every array stored in the cache section of the
+// features file
+template<typename D, typename F>
+static void database_features_cache_arrays(D& db, F&& f)
+{
+	f(db.features_weight);
+	f(db.search_features_order);
+	f(db.search_features);
+	f(db.search_features_blocked);
+	f(db.search_features_quantized);
+	f(db.search_features_quantized_offset);
+	f(db.search_features_quantized_scale);
+
+	f(db.bound_sm_min);
+	f(db.bound_sm_max);
+	f(db.bound_lr_min);
+	f(db.bound_lr_max);
+	f(db.bound_sm_tags_or);
+	f(db.bound_sm_tags_and);
+	f(db.bound_lr_tags_or);
+	f(db.bound_lr_tags_and);
+
+	f(db.kdtree_left);
+	f(db.kdtree_right);
+	f(db.kdtree_leaf);
+	f(db.kdtree_bound_min);
+	f(db.kdtree_bound_max);
+	f(db.kdtree_features_blocked);
+	f(db.kdtree_frames);
+	f(db.kdtree_range_stops);
+
+	f(db.pca_mean);
+	f(db.pca_basis);
+	f(db.pca_projections);
+	f(db.pca_norms);
+	f(db.pca_covariance);
+}
+
+bool database_save_matching_features(const database& db, const char* filename, const uint64_t hash)
+{
+	FILE* f = mapped_file_create(filename);
+	if (f == NULL) { return false; }
 
 	array2d_write(db.features, f);
 	array1d_write(db.features_offset, f);
 	array1d_write(db.features_scale, f);
 
-	fclose(f);
+	int version = FEATURES_CACHE_VERSION;
+	fwrite(&version, sizeof(int), 1, f);
+	fwrite(&hash, sizeof(uint64_t), 1, f);
+
+	database_features_cache_arrays(db, [&](const auto& arr) { database_mapped_write(arr, f); });
+
+	return mapped_file_commit(f, filename);
+}
+
+bool database_load_matching_features(database& db, const char* filename, const uint64_t hash)
+{
+	mapped_file file;
+	if (!mapped_file_open(file, filename)) { return false; }
+
+	size_t offset = 0;
+	// These are not aligned so are copied out of the mapping
+	if (!mapped_file_copy_array2d(db.features, file, offset) ||
+		!mapped_file_copy_array1d(db.features_offset, file, offset) ||
+		!mapped_file_copy_array1d(db.features_scale, file, offset))
+	{
+		return false;
+	}
+
+	// Files without a cache section end here
+	int version = 0;
+	uint64_t file_hash = 0;
+	if (!mapped_file_read(&version, sizeof(int), file, offset) ||
+		!mapped_file_read(&file_hash, sizeof(uint64_t), file, offset))
+	{
+		return false;
+	}
+
+	if (version != FEATURES_CACHE_VERSION ||
+		file_hash != hash ||
+		db.features.rows != db.nframes())
+	{
+		return false;
+	}
+
+	bool found = true;
+	database_features_cache_arrays(db, [&](auto& arr) { found = found && database_mapped_read(arr, file, offset); });
+
+	if (!found)
+	{
+		database_features_cache_arrays(db, [](auto& arr) { database_mapped_clear(arr); });
+		return false;
+	}
+
+	// Arrays now point into the new mapping so the old one can go
+	mapped_file_swap(db.features_mapping, file);
+
+	return true;
+}
+
+uint64_t database_features_hash(
+	const database& db,
+	const float feature_weight_foot_position,
+	const float feature_weight_foot_velocity,
+	const float feature_weight_hip_velocity,
+	const float feature_weight_trajectory_positions,
+	const float feature_weight_trajectory_directions)
+{
+	uint64_t hash = db.hash;
+
+	const float weights[] = {
+		feature_weight_foot_position,
+		feature_weight_foot_velocity,
+		feature_weight_hip_velocity,
+		feature_weight_trajectory_positions,
+		feature_weight_trajectory_directions };
+
+	hash = container_hash_bytes(hash, weights, sizeof(weights));
+
+	// Anything that changes the features or layout of the cache
+	const int schema[] = {
+		FEATURES_CACHE_VERSION,
+		BOUND_SM_SIZE,
+		BOUND_LR_SIZE,
+		FEATURES_PAD,
+		PCA_COMPONENTS,
+		Bone_LeftFoot,
+		Bone_RightFoot,
+		Bone_Hips };
+
+	hash = container_hash_bytes(hash, schema, sizeof(schema));
+
+	return hash;
+}
+
+//--------------------------------------
+
+template<typename T>
+static bool database_container_chunk(array1d<T>& arr, const container& c, const char* name, const bool load)
+{
+	if (!load) { arr.resize(0); return true; }
+	return container_map_array1d(arr, c, name);
+}
+
+template<typename T>
+static bool database_container_chunk(array2d<T>& arr, const container& c, const char* name, const bool load)
+{
+	if (!load) { arr.resize(0, 0); return true; }
+	return container_map_array2d(arr, c, name);
+}
+
+// Map or clear every array depending on the groups given.
+// All chunks are visited even when some are missing.
+static bool database_container_chunks(database& db, const container& c, const uint32_t chunks)
+{
+	bool bones = chunks & DATABASE_CHUNK_BONES;
+	bool bone_velocities = chunks & DATABASE_CHUNK_BONE_VELOCITIES;
+	bool ranges = chunks & DATABASE_CHUNK_RANGES;
+	bool contacts = chunks & DATABASE_CHUNK_CONTACTS;
+	bool tags = chunks & DATABASE_CHUNK_TAGS;
+	bool features = chunks & DATABASE_CHUNK_FEATURES;
+	bool search = chunks & DATABASE_CHUNK_SEARCH;
+
+	bool found = true;
+
+	found &= database_container_chunk(db.bone_positions, c, "bone_positions", bones);
+	found &= database_container_chunk(db.bone_rotations, c, "bone_rotations", bones);
+	found &= database_container_chunk(db.bone_parents, c, "bone_parents", bones);
+	found &= database_container_chunk(db.bone_velocities, c, "bone_velocities", bone_velocities);
+	found &= database_container_chunk(db.bone_angular_velocities, c, "bone_angular_velocities", bone_velocities);
+
+	found &= database_container_chunk(db.range_starts, c, "range_starts", ranges);
+	found &= database_container_chunk(db.range_stops, c, "range_stops", ranges);
+	found &= database_container_chunk(db.range_index, c, "range_index", ranges);
+
+	found &= database_container_chunk(db.contact_states, c, "contact_states", contacts);
+	found &= database_container_chunk(db.frame_tags, c, "frame_tags", tags);
+
+	found &= database_container_chunk(db.features, c, "features", features);
+	found &= database_container_chunk(db.features_offset, c, "features_offset", features);
+	found &= database_container_chunk(db.features_scale, c, "features_scale", features);
+	found &= database_container_chunk(db.features_weight, c, "features_weight", features);
+
+	found &= database_container_chunk(db.search_features_order, c, "search_features_order", search);
+	found &= database_container_chunk(db.search_features, c, "search_features", search);
+	found &= database_container_chunk(db.search_features_blocked, c, "search_features_blocked", search);
+	found &= database_container_chunk(db.search_features_quantized, c, "search_features_quantized", search);
+	found &= database_container_chunk(db.search_features_quantized_offset, c, "search_features_quantized_offset", search);
+	found &= database_container_chunk(db.search_features_quantized_scale, c, "search_features_quantized_scale", search);
+
+	found &= database_container_chunk(db.bound_sm_min, c, "bound_sm_min", search);
+	found &= database_container_chunk(db.bound_sm_max, c, "bound_sm_max", search);
+	found &= database_container_chunk(db.bound_lr_min, c, "bound_lr_min", search);
+	found &= database_container_chunk(db.bound_lr_max, c, "bound_lr_max", search);
+	found &= database_container_chunk(db.bound_sm_tags_or, c, "bound_sm_tags_or", search);
+	found &= database_container_chunk(db.bound_sm_tags_and, c, "bound_sm_tags_and", search);
+	found &= database_container_chunk(db.bound_lr_tags_or, c, "bound_lr_tags_or", search);
+	found &= database_container_chunk(db.bound_lr_tags_and, c, "bound_lr_tags_and", search);
+
+	found &= database_container_chunk(db.kdtree_left, c, "kdtree_left", search);
+	found &= database_container_chunk(db.kdtree_right, c, "kdtree_right", search);
+	found &= database_container_chunk(db.kdtree_leaf, c, "kdtree_leaf", search);
+	found &= database_container_chunk(db.kdtree_bound_min, c, "kdtree_bound_min", search);
+	found &= database_container_chunk(db.kdtree_bound_max, c, "kdtree_bound_max", search);
+	found &= database_container_chunk(db.kdtree_features_blocked, c, "kdtree_features_blocked", search);
+	found &= database_container_chunk(db.kdtree_frames, c, "kdtree_frames", search);
+	found &= database_container_chunk(db.kdtree_range_stops, c, "kdtree_range_stops", search);
+
+	found &= database_container_chunk(db.pca_mean, c, "pca_mean", search);
+	found &= database_container_chunk(db.pca_basis, c, "pca_basis", search);
+	found &= database_container_chunk(db.pca_projections, c, "pca_projections", search);
+	found &= database_container_chunk(db.pca_norms, c, "pca_norms", search);
+	found &= database_container_chunk(db.pca_covariance, c, "pca_covariance", search);
+
+	return found;
+}
+
+bool database_save_container(const database& db, const char* filename)
+{
+	container_writer w;
+	if (!container_writer_open(w, filename)) { return false; }
+
+	array1d<uint64_t> hash(1);
+	hash(0) = db.hash;
+	container_write_array1d(w, "hash", hash);
+
+	container_write_array2d(w, "bone_positions", db.bone_positions);
+	container_write_array2d(w, "bone_rotations", db.bone_rotations);
+	container_write_array1d(w, "bone_parents", db.bone_parents);
+	container_write_array2d(w, "bone_velocities", db.bone_velocities);
+	container_write_array2d(w, "bone_angular_velocities", db.bone_angular_velocities);
+
+	container_write_array1d(w, "range_starts", db.range_starts);
+	container_write_array1d(w, "range_stops", db.range_stops);
+	container_write_array1d(w, "range_index", db.range_index);
+
+	container_write_array2d(w, "contact_states", db.contact_states);
+	container_write_array1d(w, "frame_tags", db.frame_tags);
+
+	if (db.features.rows == db.nframes() && db.features_weight.size == db.nfeatures())
+	{
+		container_write_array2d(w, "features", db.features);
+		container_write_array1d(w, "features_offset", db.features_offset);
+		container_write_array1d(w, "features_scale", db.features_scale);
+		container_write_array1d(w, "features_weight", db.features_weight);
+	}
+
+	if (db.search_features.rows == db.nframes())
+	{
+		container_write_array1d(w, "search_features_order", db.search_features_order);
+		container_write_array2d(w, "search_features", db.search_features);
+		container_write_array2d(w, "search_features_blocked", db.search_features_blocked);
+		container_write_array2d(w, "search_features_quantized", db.search_features_quantized);
+		container_write_array1d(w, "search_features_quantized_offset", db.search_features_quantized_offset);
+		container_write_array1d(w, "search_features_quantized_scale", db.search_features_quantized_scale);
+
+		container_write_array2d(w, "bound_sm_min", db.bound_sm_min);
+		container_write_array2d(w, "bound_sm_max", db.bound_sm_max);
+		container_write_array2d(w, "bound_lr_min", db.bound_lr_min);
+		container_write_array2d(w, "bound_lr_max", db.bound_lr_max);
+		container_write_array1d(w, "bound_sm_tags_or", db.bound_sm_tags_or);
+		container_write_array1d(w, "bound_sm_tags_and", db.bound_sm_tags_and);
+		container_write_array1d(w, "bound_lr_tags_or", db.bound_lr_tags_or);
+		container_write_array1d(w, "bound_lr_tags_and", db.bound_lr_tags_and);
+
+		container_write_array1d(w, "kdtree_left", db.kdtree_left);
+		container_write_array1d(w, "kdtree_right", db.kdtree_right);
+		container_write_array1d(w, "kdtree_leaf", db.kdtree_leaf);
+		container_write_array2d(w, "kdtree_bound_min", db.kdtree_bound_min);
+		container_write_array2d(w, "kdtree_bound_max", db.kdtree_bound_max);
+		container_write_array2d(w, "kdtree_features_blocked", db.kdtree_features_blocked);
+		container_write_array2d(w, "kdtree_frames", db.kdtree_frames);
+		container_write_array2d(w, "kdtree_range_stops", db.kdtree_range_stops);
+
+		container_write_array1d(w, "pca_mean", db.pca_mean);
+		container_write_array2d(w, "pca_basis", db.pca_basis);
+		container_write_array2d(w, "pca_projections", db.pca_projections);
+		container_write_array1d(w, "pca_norms", db.pca_norms);
+		container_write_array2d(w, "pca_covariance", db.pca_covariance);
+	}
+
+	return container_writer_close(w);
+}
+
+bool database_load_container(
+	database& db,
+	const char* filename,
+	const uint32_t chunks,
+	const bool verify)
+{
+	container c;
+	array1d<uint64_t> hash;
+
+	if (!container_open(c, filename) ||
+		(verify && !container_verify(c)) ||
+		!container_read_array1d(hash, c, "hash") ||
+		hash.size != 1 ||
+		!database_container_chunks(db, c, chunks))
+	{
+		database_container_chunks(db, c, 0);
+		return false;
+	}
+
+	db.hash = hash(0);
+
+	// Arrays now point into the new mapping so the old one can go
+	mapped_file_swap(db.mapping, c.file);
+
+	return true;
+}
+
+bool database_convert_container(const char* database_filename, const char* filename)
+{
+	database db;
+	database_load(db, database_filename);
+	return database_save_container(db, filename);
 }
 
 // When we add an offset to a frame in the database there is a chance
 // it will go out of the relevant range so here we can clamp it to 
-// the last frame of that range.
+// the last frame of that range. The frame must be inside a range.
 int database_trajectory_index_clamp(database& db, int frame, int offset)
 {
-	for (int i = 0; i < db.nranges(); i++)
+	assert(db.range_index.size == db.nframes());
+	int r = db.range_index(frame);
+	assert(r >= 0);
+	return clamp(frame + offset, db.range_starts(r), db.range_stops(r) - 1);
+}
+
+void database_build_range_index(database& db)
+{
+	db.range_index.resize(db.nframes());
+	db.range_index.set(-1);
+
+	for (int r = 0; r < db.nranges(); r++)
 	{
-		if (frame >= db.range_starts(i) && frame < db.range_stops(i))
+		for (int i = db.range_starts(r); i < db.range_stops(r); i++)
 		{
-			return clamp(frame + offset, db.range_starts(i), db.range_stops(i) - 1);
+			db.range_index(i) = r;
 		}
 	}
-
-	assert(false);
-	return -1;
 }
 
 //--------------------------------------
@@ -58,32 +565,56 @@ void normalize_feature(
 	slice1d<float> features_scale,
 	const int offset,
 	const int size,
-	const float weight)
+	const float weight,
+	thread_pool* pool)
 {
+	int nchunks = (features.rows + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE;
+	array2d<float> partials(nchunks, size);
+
 	// First compute what is essentially the mean 
 	// value for each feature dimension
+	partials.zero();
+	database_build_chunks(pool, features.rows, [&](int chunk, int start, int stop)
+	{
+		for (int i = start; i < stop; i++)
+		{
+			for (int j = 0; j < size; j++)
+			{
+				partials(chunk, j) += features(i, offset + j) / features.rows;
+			}
+		}
+	});
+
 	for (int j = 0; j < size; j++)
 	{
 		features_offset(offset + j) = 0.0f;
+		for (int c = 0; c < nchunks; c++)
+		{
+			features_offset(offset + j) += partials(c, j);
+		}
 	}
 
-	for (int i = 0; i < features.rows; i++)
+	// Now compute the variance of each feature dimension
+	partials.zero();
+	database_build_chunks(pool, features.rows, [&](int chunk, int start, int stop)
 	{
-		for (int j = 0; j < size; j++)
+		for (int i = start; i < stop; i++)
 		{
-			features_offset(offset + j) += features(i, offset + j) / features.rows;
+			for (int j = 0; j < size; j++)
+			{
+				partials(chunk, j) += squaref(features(i, offset + j) - features_offset(offset + j)) / features.rows;
+			}
 		}
-	}
+	});
 
-	// Now compute the variance of each feature dimension
 	array1d<float> vars(size);
 	vars.zero();
 
-	for (int i = 0; i < features.rows; i++)
+	for (int j = 0; j < size; j++)
 	{
-		for (int j = 0; j < size; j++)
+		for (int c = 0; c < nchunks; c++)
 		{
-			vars(j) += squaref(features(i, offset + j) - features_offset(offset + j)) / features.rows;
+			vars(j) += partials(c, j);
 		}
 	}
 
@@ -106,13 +637,16 @@ void normalize_feature(
 	}
 
 	// Using the offset and scale we can then normalize the features
-	for (int i = 0; i < features.rows; i++)
+	database_build_chunks(pool, features.rows, [&](int, int start, int stop)
 	{
-		for (int j = 0; j < size; j++)
+		for (int i = start; i < stop; i++)
 		{
-			features(i, offset + j) = (features(i, offset + j) - features_offset(offset + j)) / features_scale(offset + j);
+			for (int j = 0; j < size; j++)
+			{
+				features(i, offset + j) = (features(i, offset + j) - features_offset(offset + j)) / features_scale(offset + j);
+			}
 		}
-	}
+	});
 }
 
 void denormalize_features(
@@ -238,6 +772,48 @@ void forward_kinematics_full(
 	}
 }
 
+// Same but including velocity
+void forward_kinematics_velocity_full(
+	slice1d<vec3> global_bone_positions,
+	slice1d<vec3> global_bone_velocities,
+	slice1d<quat> global_bone_rotations,
+	slice1d<vec3> global_bone_angular_velocities,
+	const slice1d<vec3> local_bone_positions,
+	const slice1d<vec3> local_bone_velocities,
+	const slice1d<quat> local_bone_rotations,
+	const slice1d<vec3> local_bone_angular_velocities,
+	const slice1d<int> bone_parents)
+{
+	for (int i = 0; i < bone_parents.size; i++)
+	{
+		// Assumes bones are always sorted from root onwards
+		assert(bone_parents(i) < i);
+
+		if (bone_parents(i) == -1)
+		{
+			global_bone_positions(i) = local_bone_positions(i);
+			global_bone_velocities(i) = local_bone_velocities(i);
+			global_bone_rotations(i) = local_bone_rotations(i);
+			global_bone_angular_velocities(i) = local_bone_angular_velocities(i);
+		}
+		else
+		{
+			vec3 parent_position = global_bone_positions(bone_parents(i));
+			vec3 parent_velocity = global_bone_velocities(bone_parents(i));
+			quat parent_rotation = global_bone_rotations(bone_parents(i));
+			vec3 parent_angular_velocity = global_bone_angular_velocities(bone_parents(i));
+
+			global_bone_positions(i) = quat_mul_vec3(parent_rotation, local_bone_positions(i)) + parent_position;
+			global_bone_velocities(i) =
+				parent_velocity +
+				quat_mul_vec3(parent_rotation, local_bone_velocities(i)) +
+				cross(parent_angular_velocity, quat_mul_vec3(parent_rotation, local_bone_positions(i)));
+			global_bone_rotations(i) = quat_mul(parent_rotation, local_bone_rotations(i));
+			global_bone_angular_velocities(i) = quat_mul_vec3(parent_rotation, local_bone_angular_velocities(i) + parent_angular_velocity);
+		}
+	}
+}
+
 // Compute forward kinematics of just some joints using a
 // mask to indicate which joints are already computed
 void forward_kinematics_partial(
@@ -333,190 +909,1054 @@ void forward_kinematics_velocity_partial(
 
 //--------------------------------------
 
+// The cached features are only checked against the hash from
+// `database_features_hash`, which cannot see how the features
+// are computed. Any change to the extractors below (e.g. the 20,
+// 40 and 60 frame trajectory offsets) or to the order they are
+// called in must bump FEATURES_CACHE_VERSION, or stale features
+// will be loaded from the cache.
+
 // Compute a feature for the position of a bone relative to the simulation/root bone
-void compute_bone_position_feature(database& db, int& offset, int bone, float weight)
+void compute_bone_position_feature(database& db, int& offset, const int i, const int bone, const slice1d<vec3> global_bone_positions)
 {
-	for (int i = 0; i < db.nframes(); i++)
-	{
-		vec3 bone_position;
-		quat bone_rotation;
-
-		forward_kinematics(
-			bone_position,
-			bone_rotation,
-			db.bone_positions(i),
-			db.bone_rotations(i),
-			db.bone_parents,
-			bone);
-
-		bone_position = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), bone_position - db.bone_positions(i, 0));
-
-		db.features(i, offset + 0) = bone_position.x;
-		db.features(i, offset + 1) = bone_position.y;
-		db.features(i, offset + 2) = bone_position.z;
-	}
+	vec3 bone_position = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), global_bone_positions(bone) - db.bone_positions(i, 0));
 
-	normalize_feature(db.features, db.features_offset, db.features_scale, offset, 3, weight);
+	db.features(i, offset + 0) = bone_position.x;
+	db.features(i, offset + 1) = bone_position.y;
+	db.features(i, offset + 2) = bone_position.z;
 
 	offset += 3;
 }
 
 // Similar but for a bone's velocity
-void compute_bone_velocity_feature(database& db, int& offset, int bone, float weight)
+void compute_bone_velocity_feature(database& db, int& offset, const int i, const int bone, const slice1d<vec3> global_bone_velocities)
 {
-	for (int i = 0; i < db.nframes(); i++)
-	{
-		vec3 bone_position;
-		vec3 bone_velocity;
-		quat bone_rotation;
-		vec3 bone_angular_velocity;
-
-		forward_kinematics_velocity(
-			bone_position,
-			bone_velocity,
-			bone_rotation,
-			bone_angular_velocity,
-			db.bone_positions(i),
-			db.bone_velocities(i),
-			db.bone_rotations(i),
-			db.bone_angular_velocities(i),
-			db.bone_parents,
-			bone);
+	vec3 bone_velocity = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), global_bone_velocities(bone));
 
-		bone_velocity = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), bone_velocity);
-
-		db.features(i, offset + 0) = bone_velocity.x;
-		db.features(i, offset + 1) = bone_velocity.y;
-		db.features(i, offset + 2) = bone_velocity.z;
-	}
-
-	normalize_feature(db.features, db.features_offset, db.features_scale, offset, 3, weight);
+	db.features(i, offset + 0) = bone_velocity.x;
+	db.features(i, offset + 1) = bone_velocity.y;
+	db.features(i, offset + 2) = bone_velocity.z;
 
 	offset += 3;
 }
 
 // Compute the trajectory at 20, 40, and 60 frames in the future
-void compute_trajectory_position_feature(database& db, int& offset, float weight)
+void compute_trajectory_position_feature(database& db, int& offset, const int i)
 {
-	for (int i = 0; i < db.nframes(); i++)
-	{
-		int t0 = database_trajectory_index_clamp(db, i, 20);
-		int t1 = database_trajectory_index_clamp(db, i, 40);
-		int t2 = database_trajectory_index_clamp(db, i, 60);
-
-		vec3 trajectory_pos0 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t0, 0) - db.bone_positions(i, 0));
-		vec3 trajectory_pos1 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t1, 0) - db.bone_positions(i, 0));
-		vec3 trajectory_pos2 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t2, 0) - db.bone_positions(i, 0));
+	int t0 = database_trajectory_index_clamp(db, i, 20);
+	int t1 = database_trajectory_index_clamp(db, i, 40);
+	int t2 = database_trajectory_index_clamp(db, i, 60);
 
-		db.features(i, offset + 0) = trajectory_pos0.x;
-		db.features(i, offset + 1) = trajectory_pos0.z;
-		db.features(i, offset + 2) = trajectory_pos1.x;
-		db.features(i, offset + 3) = trajectory_pos1.z;
-		db.features(i, offset + 4) = trajectory_pos2.x;
-		db.features(i, offset + 5) = trajectory_pos2.z;
-	}
+	vec3 trajectory_pos0 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t0, 0) - db.bone_positions(i, 0));
+	vec3 trajectory_pos1 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t1, 0) - db.bone_positions(i, 0));
+	vec3 trajectory_pos2 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t2, 0) - db.bone_positions(i, 0));
 
-	normalize_feature(db.features, db.features_offset, db.features_scale, offset, 6, weight);
+	db.features(i, offset + 0) = trajectory_pos0.x;
+	db.features(i, offset + 1) = trajectory_pos0.z;
+	db.features(i, offset + 2) = trajectory_pos1.x;
+	db.features(i, offset + 3) = trajectory_pos1.z;
+	db.features(i, offset + 4) = trajectory_pos2.x;
+	db.features(i, offset + 5) = trajectory_pos2.z;
 
 	offset += 6;
 }
 
 // Same for direction
-void compute_trajectory_direction_feature(database& db, int& offset, float weight)
+void compute_trajectory_direction_feature(database& db, int& offset, const int i)
 {
-	for (int i = 0; i < db.nframes(); i++)
-	{
-		int t0 = database_trajectory_index_clamp(db, i, 20);
-		int t1 = database_trajectory_index_clamp(db, i, 40);
-		int t2 = database_trajectory_index_clamp(db, i, 60);
-
-		vec3 trajectory_dir0 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t0, 0), vec3(0, 0, 1)));
-		vec3 trajectory_dir1 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t1, 0), vec3(0, 0, 1)));
-		vec3 trajectory_dir2 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t2, 0), vec3(0, 0, 1)));
+	int t0 = database_trajectory_index_clamp(db, i, 20);
+	int t1 = database_trajectory_index_clamp(db, i, 40);
+	int t2 = database_trajectory_index_clamp(db, i, 60);
 
-		db.features(i, offset + 0) = trajectory_dir0.x;
-		db.features(i, offset + 1) = trajectory_dir0.z;
-		db.features(i, offset + 2) = trajectory_dir1.x;
-		db.features(i, offset + 3) = trajectory_dir1.z;
-		db.features(i, offset + 4) = trajectory_dir2.x;
-		db.features(i, offset + 5) = trajectory_dir2.z;
-	}
+	vec3 trajectory_dir0 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t0, 0), vec3(0, 0, 1)));
+	vec3 trajectory_dir1 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t1, 0), vec3(0, 0, 1)));
+	vec3 trajectory_dir2 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t2, 0), vec3(0, 0, 1)));
 
-	normalize_feature(db.features, db.features_offset, db.features_scale, offset, 6, weight);
+	db.features(i, offset + 0) = trajectory_dir0.x;
+	db.features(i, offset + 1) = trajectory_dir0.z;
+	db.features(i, offset + 2) = trajectory_dir1.x;
+	db.features(i, offset + 3) = trajectory_dir1.z;
+	db.features(i, offset + 4) = trajectory_dir2.x;
+	db.features(i, offset + 5) = trajectory_dir2.z;
 
 	offset += 6;
 }
 
-// Build the Motion Matching search acceleration structure. Here we
-// just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
-// and BOUND_LR_SIZE frames
-void database_build_bounds(database& db)
+// Build the padded, blocked and quantized copies of the features 
+// used by the search. These are saved in the cache section of the
+// features file by `database_save_matching_features`.
+void database_build_search_features(database& db)
 {
-	int nbound_sm = ((db.nframes() + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE);
-	int nbound_lr = ((db.nframes() + BOUND_LR_SIZE - 1) / BOUND_LR_SIZE);
+	int npadded = ((db.nfeatures() + FEATURES_PAD - 1) / FEATURES_PAD) * FEATURES_PAD;
+	int nblocks = ((db.nframes() + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE);
 
-	db.bound_sm_min.resize(nbound_sm, db.nfeatures());
-	db.bound_sm_max.resize(nbound_sm, db.nfeatures());
-	db.bound_lr_min.resize(nbound_lr, db.nfeatures());
-	db.bound_lr_max.resize(nbound_lr, db.nfeatures());
+	db.search_features.resize(db.nframes(), npadded);
+	db.search_features_blocked.resize(nblocks, npadded * BOUND_SM_SIZE);
 
-	db.bound_sm_min.set(FLT_MAX);
-	db.bound_sm_max.set(FLT_MIN);
-	db.bound_lr_min.set(FLT_MAX);
-	db.bound_lr_max.set(FLT_MIN);
+	db.search_features.zero();
+	db.search_features_blocked.zero();
+
+	// Order dimensions by variance, which is proportional to their
+	// expected contribution to the cost, so that the early-out in 
+	// the search kernels happens as soon as possible
+	array1d<float> variance(db.nfeatures());
+	variance.zero();
+
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		float mean = 0.0f;
+		for (int i = 0; i < db.nframes(); i++)
+		{
+			mean += db.features(i, j) / db.nframes();
+		}
+
+		for (int i = 0; i < db.nframes(); i++)
+		{
+			variance(j) += squaref(db.features(i, j) - mean) / db.nframes();
+		}
+	}
+
+	db.search_features_order.resize(db.nfeatures());
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		db.search_features_order(j) = j;
+	}
+
+	std::stable_sort(db.search_features_order.data, db.search_features_order.data + db.nfeatures(), 
+		[&](int a, int b) { return variance(a) > variance(b); });
 
 	for (int i = 0; i < db.nframes(); i++)
 	{
 		int i_sm = i / BOUND_SM_SIZE;
-		int i_lr = i / BOUND_LR_SIZE;
+		int k = i % BOUND_SM_SIZE;
 
 		for (int j = 0; j < db.nfeatures(); j++)
 		{
-			db.bound_sm_min(i_sm, j) = minf(db.bound_sm_min(i_sm, j), db.features(i, j));
-			db.bound_sm_max(i_sm, j) = maxf(db.bound_sm_max(i_sm, j), db.features(i, j));
-			db.bound_lr_min(i_lr, j) = minf(db.bound_lr_min(i_lr, j), db.features(i, j));
-			db.bound_lr_max(i_lr, j) = maxf(db.bound_lr_max(i_lr, j), db.features(i, j));
+			float value = db.features(i, db.search_features_order(j));
+			db.search_features(i, j) = value;
+			db.search_features_blocked(i_sm, j * BOUND_SM_SIZE + k) = value;
 		}
 	}
-}
 
-// Build all motion matching features and acceleration structure
-void database_build_matching_features(
-	database& db,
-	const float feature_weight_foot_position,
-	const float feature_weight_foot_velocity,
-	const float feature_weight_hip_velocity,
-	const float feature_weight_trajectory_positions,
-	const float feature_weight_trajectory_directions)
-{
-	int nfeatures =
-		3 + // Left Foot Position
-		3 + // Right Foot Position 
-		3 + // Left Foot Velocity
-		3 + // Right Foot Velocity
-		3 + // Hip Velocity
-		6 + // Trajectory Positions 2D
-		6; // Trajectory Directions 2D
+	// Quantize each dimension to [-127, 127] over its range in the
+	// database. Padding has a scale of zero so always decodes to zero.
+	db.search_features_quantized.resize(db.nframes(), npadded);
+	db.search_features_quantized_offset.resize(npadded);
+	db.search_features_quantized_scale.resize(npadded);
 
-	db.features.resize(db.nframes(), nfeatures);
-	db.features_offset.resize(nfeatures);
-	db.features_scale.resize(nfeatures);
+	db.search_features_quantized.zero();
+	db.search_features_quantized_offset.zero();
+	db.search_features_quantized_scale.zero();
 
-	int offset = 0;
-	compute_bone_position_feature(db, offset, Bone_LeftFoot, feature_weight_foot_position);
-	compute_bone_position_feature(db, offset, Bone_RightFoot, feature_weight_foot_position);
-	compute_bone_velocity_feature(db, offset, Bone_LeftFoot, feature_weight_foot_velocity);
-	compute_bone_velocity_feature(db, offset, Bone_RightFoot, feature_weight_foot_velocity);
-	compute_bone_velocity_feature(db, offset, Bone_Hips, feature_weight_hip_velocity);
-	compute_trajectory_position_feature(db, offset, feature_weight_trajectory_positions);
-	compute_trajectory_direction_feature(db, offset, feature_weight_trajectory_directions);
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		float value_min = FLT_MAX;
+		float value_max = -FLT_MAX;
 
-	assert(offset == nfeatures);
+		for (int i = 0; i < db.nframes(); i++)
+		{
+			value_min = minf(value_min, db.search_features(i, j));
+			value_max = maxf(value_max, db.search_features(i, j));
+		}
 
-	database_build_bounds(db);
-}
+		if (db.nframes() == 0) { continue; }
 
-// Motion Matching search function essentially consists
+		float offset = (value_min + value_max) / 2.0f;
+		float scale = (value_max - value_min) / 254.0f;
+
+		db.search_features_quantized_offset(j) = offset;
+		db.search_features_quantized_scale(j) = scale;
+
+		for (int i = 0; i < db.nframes(); i++)
+		{
+			float code = scale > 0.0f ? roundf((db.search_features(i, j) - offset) / scale) : 0.0f;
+			db.search_features_quantized(i, j) = (signed char)clampf(code, -127.0f, 127.0f);
+		}
+	}
+}
+
+// Build the Motion Matching search acceleration structure. Here we
+// just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
+// and BOUND_LR_SIZE frames
+void database_build_bounds(database& db, thread_pool* pool)
+{
+	int nbound_sm = ((db.nframes() + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE);
+	int nbound_lr = ((db.nframes() + BOUND_LR_SIZE - 1) / BOUND_LR_SIZE);
+
+	db.bound_sm_min.resize(nbound_sm, db.nfeatures_padded());
+	db.bound_sm_max.resize(nbound_sm, db.nfeatures_padded());
+	db.bound_lr_min.resize(nbound_lr, db.nfeatures_padded());
+	db.bound_lr_max.resize(nbound_lr, db.nfeatures_padded());
+
+	db.bound_sm_min.set(FLT_MAX);
+	db.bound_sm_max.set(FLT_MIN);
+	db.bound_lr_min.set(FLT_MAX);
+	db.bound_lr_max.set(FLT_MIN);
+
+	// Chunks are a multiple of BOUND_LR_SIZE so each box
+	// is only ever written to by a single chunk
+	database_build_chunks(pool, db.nframes(), [&](int, int start, int stop)
+	{
+		for (int i = start; i < stop; i++)
+		{
+			int i_sm = i / BOUND_SM_SIZE;
+			int i_lr = i / BOUND_LR_SIZE;
+
+			for (int j = 0; j < db.nfeatures_padded(); j++)
+			{
+				db.bound_sm_min(i_sm, j) = minf(db.bound_sm_min(i_sm, j), db.search_features(i, j));
+				db.bound_sm_max(i_sm, j) = maxf(db.bound_sm_max(i_sm, j), db.search_features(i, j));
+				db.bound_lr_min(i_lr, j) = minf(db.bound_lr_min(i_lr, j), db.search_features(i, j));
+				db.bound_lr_max(i_lr, j) = maxf(db.bound_lr_max(i_lr, j), db.search_features(i, j));
+			}
+		}
+	});
+
+	// Tags of all frames in each box combined with OR and AND
+	if (db.frame_tags.size != db.nframes())
+	{
+		db.frame_tags.resize(db.nframes());
+		db.frame_tags.zero();
+	}
+
+	db.bound_sm_tags_or.resize(nbound_sm);
+	db.bound_sm_tags_and.resize(nbound_sm);
+	db.bound_lr_tags_or.resize(nbound_lr);
+	db.bound_lr_tags_and.resize(nbound_lr);
+
+	db.bound_sm_tags_or.zero();
+	db.bound_sm_tags_and.set(~(uint64_t)0);
+	db.bound_lr_tags_or.zero();
+	db.bound_lr_tags_and.set(~(uint64_t)0);
+
+	database_build_chunks(pool, db.nframes(), [&](int, int start, int stop)
+	{
+		for (int i = start; i < stop; i++)
+		{
+			int i_sm = i / BOUND_SM_SIZE;
+			int i_lr = i / BOUND_LR_SIZE;
+
+			db.bound_sm_tags_or(i_sm) |= db.frame_tags(i);
+			db.bound_sm_tags_and(i_sm) &= db.frame_tags(i);
+			db.bound_lr_tags_or(i_lr) |= db.frame_tags(i);
+			db.bound_lr_tags_and(i_lr) &= db.frame_tags(i);
+		}
+	});
+}
+
+// Recursively split the frames in order[start, stop) at 
+// the median of the dimension with the largest spread. Split
+// points are kept at multiples of BOUND_SM_SIZE so that every
+// leaf except the last is full.
+static int database_build_kdtree_node(
+	std::vector<int>& left,
+	std::vector<int>& right,
+	std::vector<int>& leaf,
+	std::vector<int>& order,
+	const database& db,
+	const int start,
+	const int stop)
+{
+	int node = (int)left.size();
+	left.push_back(-1);
+	right.push_back(-1);
+	leaf.push_back(-1);
+
+	if (stop - start <= BOUND_SM_SIZE)
+	{
+		leaf[node] = start / BOUND_SM_SIZE;
+		return node;
+	}
+
+	// Find dimension with largest spread
+	int split_dim = 0;
+	float split_spread = -1.0f;
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		float vmin = FLT_MAX, vmax = -FLT_MAX;
+		for (int i = start; i < stop; i++)
+		{
+			vmin = minf(vmin, db.search_features(order[i], j));
+			vmax = maxf(vmax, db.search_features(order[i], j));
+		}
+
+		if (vmax - vmin > split_spread)
+		{
+			split_dim = j;
+			split_spread = vmax - vmin;
+		}
+	}
+
+	// Split at the median rounded to a whole number of leaves
+	int half = (((stop - start) / 2 + BOUND_SM_SIZE / 2) / BOUND_SM_SIZE) * BOUND_SM_SIZE;
+	int mid = start + (half < BOUND_SM_SIZE ? BOUND_SM_SIZE : half);
+
+	std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + stop, [&](int a, int b)
+	{
+		return db.search_features(a, split_dim) < db.search_features(b, split_dim);
+	});
+
+	int left_node = database_build_kdtree_node(left, right, leaf, order, db, start, mid);
+	int right_node = database_build_kdtree_node(left, right, leaf, order, db, mid, stop);
+	left[node] = left_node;
+	right[node] = right_node;
+
+	return node;
+}
+
+void database_build_kdtree(database& db)
+{
+	std::vector<int> left, right, leaf, order(db.nframes());
+	for (int i = 0; i < db.nframes(); i++)
+	{
+		order[i] = i;
+	}
+
+	database_build_kdtree_node(left, right, leaf, order, db, 0, db.nframes());
+
+	int nnodes = (int)left.size();
+	int nleaves = (db.nframes() + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE;
+
+	db.kdtree_left.resize(nnodes);
+	db.kdtree_right.resize(nnodes);
+	db.kdtree_leaf.resize(nnodes);
+	memcpy(db.kdtree_left.data, left.data(), nnodes * sizeof(int));
+	memcpy(db.kdtree_right.data, right.data(), nnodes * sizeof(int));
+	memcpy(db.kdtree_leaf.data, leaf.data(), nnodes * sizeof(int));
+
+	// Find the range stop of each frame
+	array1d<int> range_stops(db.nframes());
+	range_stops.set(-1);
+	for (int r = 0; r < db.nranges(); r++)
+	{
+		for (int i = db.range_starts(r); i < db.range_stops(r); i++)
+		{
+			range_stops(i) = db.range_stops(r);
+		}
+	}
+
+	// Copy frames into leaves
+	db.kdtree_features_blocked.resize(nleaves, db.nfeatures_padded() * BOUND_SM_SIZE);
+	db.kdtree_frames.resize(nleaves, BOUND_SM_SIZE);
+	db.kdtree_range_stops.resize(nleaves, BOUND_SM_SIZE);
+	db.kdtree_features_blocked.zero();
+	db.kdtree_frames.set(-1);
+	db.kdtree_range_stops.set(-1);
+
+	for (int o = 0; o < db.nframes(); o++)
+	{
+		int l = o / BOUND_SM_SIZE;
+		int k = o % BOUND_SM_SIZE;
+
+		db.kdtree_frames(l, k) = order[o];
+		db.kdtree_range_stops(l, k) = range_stops(order[o]);
+
+		for (int j = 0; j < db.nfeatures_padded(); j++)
+		{
+			db.kdtree_features_blocked(l, j * BOUND_SM_SIZE + k) = db.search_features(order[o], j);
+		}
+	}
+
+	// Compute bounds. Children always come after their 
+	// parent so we can go over the nodes in reverse.
+	db.kdtree_bound_min.resize(nnodes, db.nfeatures_padded());
+	db.kdtree_bound_max.resize(nnodes, db.nfeatures_padded());
+	db.kdtree_bound_min.set(FLT_MAX);
+	db.kdtree_bound_max.set(-FLT_MAX);
+
+	for (int n = nnodes - 1; n >= 0; n--)
+	{
+		if (db.kdtree_leaf(n) != -1)
+		{
+			int l = db.kdtree_leaf(n);
+			for (int k = 0; k < BOUND_SM_SIZE && db.kdtree_frames(l, k) != -1; k++)
+			{
+				for (int j = 0; j < db.nfeatures_padded(); j++)
+				{
+					float value = db.kdtree_features_blocked(l, j * BOUND_SM_SIZE + k);
+					db.kdtree_bound_min(n, j) = minf(db.kdtree_bound_min(n, j), value);
+					db.kdtree_bound_max(n, j) = maxf(db.kdtree_bound_max(n, j), value);
+				}
+			}
+		}
+		else
+		{
+			int nl = db.kdtree_left(n);
+			int nr = db.kdtree_right(n);
+			for (int j = 0; j < db.nfeatures_padded(); j++)
+			{
+				db.kdtree_bound_min(n, j) = minf(db.kdtree_bound_min(nl, j), db.kdtree_bound_min(nr, j));
+				db.kdtree_bound_max(n, j) = maxf(db.kdtree_bound_max(nl, j), db.kdtree_bound_max(nr, j));
+			}
+		}
+	}
+}
+
+// Project a (padded) feature vector onto the PCA basis
+float pca_project(
+	slice1d<float> projection,
+	const slice2d<float> pca_basis,
+	const slice1d<float> pca_mean,
+	const slice1d<float> features)
+{
+	for (int c = 0; c < pca_basis.rows; c++)
+	{
+		float value = 0.0f;
+		for (int j = 0; j < pca_basis.cols; j++)
+		{
+			value += pca_basis(c, j) * (features(j) - pca_mean(j));
+		}
+		projection(c) = value;
+	}
+
+	float norm = 0.0f;
+	for (int j = 0; j < pca_basis.cols; j++)
+	{
+		norm += squaref(features(j) - pca_mean(j));
+	}
+
+	return sqrtf(norm);
+}
+
+// Eigen decomposition of a symmetric matrix using the cyclic
+// Jacobi method. On output the columns of `vectors` are the 
+// eigenvectors and the diagonal of `a` holds the eigenvalues.
+static void database_pca_jacobi(array2d<double>& a, array2d<double>& vectors)
+{
+	int n = a.rows;
+
+	vectors.resize(n, n);
+	vectors.zero();
+	for (int i = 0; i < n; i++)
+	{
+		vectors(i, i) = 1.0;
+	}
+
+	for (int sweep = 0; sweep < 64; sweep++)
+	{
+		double off = 0.0;
+		for (int p = 0; p < n; p++)
+		{
+			for (int q = p + 1; q < n; q++)
+			{
+				off += a(p, q) * a(p, q);
+			}
+		}
+
+		if (off < 1e-20)
+		{
+			break;
+		}
+
+		for (int p = 0; p < n; p++)
+		{
+			for (int q = p + 1; q < n; q++)
+			{
+				if (fabs(a(p, q)) < 1e-30)
+				{
+					continue;
+				}
+
+				// Rotation which zeros a(p, q)
+				double theta = (a(q, q) - a(p, p)) / (2.0 * a(p, q));
+				double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+				double c = 1.0 / sqrt(t * t + 1.0);
+				double s = t * c;
+
+				for (int k = 0; k < n; k++)
+				{
+					double akp = a(k, p);
+					double akq = a(k, q);
+					a(k, p) = c * akp - s * akq;
+					a(k, q) = s * akp + c * akq;
+				}
+
+				for (int k = 0; k < n; k++)
+				{
+					double apk = a(p, k);
+					double aqk = a(q, k);
+					a(p, k) = c * apk - s * aqk;
+					a(q, k) = s * apk + c * aqk;
+				}
+
+				for (int k = 0; k < n; k++)
+				{
+					double vkp = vectors(k, p);
+					double vkq = vectors(k, q);
+					vectors(k, p) = c * vkp - s * vkq;
+					vectors(k, q) = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+}
+
+// Basis and projections from `pca_mean` and `pca_covariance`
+static void database_build_pca_components(database& db, thread_pool* pool = nullptr)
+{
+	int nfeatures = db.nfeatures();
+
+	array2d<double> covariance;
+	covariance = db.pca_covariance;
+	array2d<double> vectors;
+	database_pca_jacobi(covariance, vectors);
+
+	// Sort components by variance
+	std::vector<int> order(nfeatures);
+	for (int j = 0; j < nfeatures; j++)
+	{
+		order[j] = j;
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+	{
+		return covariance(a, a) > covariance(b, b);
+	});
+
+	db.pca_basis.zero();
+	for (int c = 0; c < PCA_COMPONENTS && c < nfeatures; c++)
+	{
+		for (int j = 0; j < nfeatures; j++)
+		{
+			db.pca_basis(c, j) = (float)vectors(j, order[c]);
+		}
+	}
+
+	database_build_chunks(pool, db.nframes(), [&](int, int start, int stop)
+	{
+		for (int i = start; i < stop; i++)
+		{
+			db.pca_norms(i) = pca_project(db.pca_projections(i), db.pca_basis, db.pca_mean, db.search_features(i));
+		}
+	});
+}
+
+void database_build_pca(database& db)
+{
+	int nfeatures = db.nfeatures();
+	int npadded = db.nfeatures_padded();
+	int nframes = db.nframes();
+
+	db.pca_mean.resize(npadded);
+	db.pca_basis.resize(PCA_COMPONENTS, npadded);
+	db.pca_projections.resize(nframes, PCA_COMPONENTS);
+	db.pca_norms.resize(nframes);
+	db.pca_covariance.resize(nfeatures, nfeatures);
+	db.pca_mean.zero();
+	db.pca_basis.zero();
+	db.pca_projections.zero();
+	db.pca_norms.zero();
+	db.pca_covariance.zero();
+
+	if (nframes == 0) { return; }
+
+	// Mean and covariance, accumulated in double
+	array1d<double> mean(nfeatures);
+	mean.zero();
+	for (int i = 0; i < nframes; i++)
+	{
+		for (int j = 0; j < nfeatures; j++)
+		{
+			mean(j) += db.search_features(i, j);
+		}
+	}
+
+	for (int j = 0; j < nfeatures; j++)
+	{
+		mean(j) /= nframes;
+		db.pca_mean(j) = (float)mean(j);
+	}
+
+	array2d<double>& covariance = db.pca_covariance;
+	for (int i = 0; i < nframes; i++)
+	{
+		for (int j0 = 0; j0 < nfeatures; j0++)
+		{
+			double d0 = db.search_features(i, j0) - mean(j0);
+			for (int j1 = j0; j1 < nfeatures; j1++)
+			{
+				covariance(j0, j1) += d0 * (db.search_features(i, j1) - mean(j1));
+			}
+		}
+	}
+
+	for (int j0 = 0; j0 < nfeatures; j0++)
+	{
+		for (int j1 = j0; j1 < nfeatures; j1++)
+		{
+			covariance(j0, j1) /= nframes;
+			covariance(j1, j0) = covariance(j0, j1);
+		}
+	}
+
+	database_build_pca_components(db);
+}
+
+// Which of the feature weights applies to a block of features
+enum
+{
+	FEATURE_WEIGHT_FOOT_POSITION = 0,
+	FEATURE_WEIGHT_FOOT_VELOCITY = 1,
+	FEATURE_WEIGHT_HIP_VELOCITY = 2,
+	FEATURE_WEIGHT_TRAJECTORY_POSITIONS = 3,
+	FEATURE_WEIGHT_TRAJECTORY_DIRECTIONS = 4,
+};
+
+struct database_feature_block
+{
+	int size;
+	int weight;
+};
+
+// Size and weight of each block of features, in the same order as
+// they are computed in `database_build_matching_features`
+static const database_feature_block database_feature_blocks[] =
+{
+	{ 3, FEATURE_WEIGHT_FOOT_POSITION }, // Left Foot Position
+	{ 3, FEATURE_WEIGHT_FOOT_POSITION }, // Right Foot Position
+	{ 3, FEATURE_WEIGHT_FOOT_VELOCITY }, // Left Foot Velocity
+	{ 3, FEATURE_WEIGHT_FOOT_VELOCITY }, // Right Foot Velocity
+	{ 3, FEATURE_WEIGHT_HIP_VELOCITY }, // Hip Velocity
+	{ 6, FEATURE_WEIGHT_TRAJECTORY_POSITIONS }, // Trajectory Positions 2D
+	{ 6, FEATURE_WEIGHT_TRAJECTORY_DIRECTIONS }, // Trajectory Directions 2D
+};
+
+static const int database_feature_nblocks = sizeof(database_feature_blocks) / sizeof(database_feature_block);
+
+static int database_feature_blocks_size()
+{
+	int size = 0;
+	for (int b = 0; b < database_feature_nblocks; b++)
+	{
+		size += database_feature_blocks[b].size;
+	}
+	return size;
+}
+
+// Weight of each feature dimension
+static void database_feature_weights(
+	slice1d<float> weights,
+	const float feature_weight_foot_position,
+	const float feature_weight_foot_velocity,
+	const float feature_weight_hip_velocity,
+	const float feature_weight_trajectory_positions,
+	const float feature_weight_trajectory_directions)
+{
+	const float block_weights[] = {
+		feature_weight_foot_position,
+		feature_weight_foot_velocity,
+		feature_weight_hip_velocity,
+		feature_weight_trajectory_positions,
+		feature_weight_trajectory_directions };
+
+	int offset = 0;
+	for (int b = 0; b < database_feature_nblocks; b++)
+	{
+		for (int j = 0; j < database_feature_blocks[b].size; j++)
+		{
+			weights(offset + j) = block_weights[database_feature_blocks[b].weight];
+		}
+		offset += database_feature_blocks[b].size;
+	}
+
+	assert(offset == weights.size);
+}
+
+// Build all motion matching features and acceleration structure
+void database_build_matching_features(
+	database& db,
+	const float feature_weight_foot_position,
+	const float feature_weight_foot_velocity,
+	const float feature_weight_hip_velocity,
+	const float feature_weight_trajectory_positions,
+	const float feature_weight_trajectory_directions,
+	thread_pool* pool)
+{
+	int nfeatures = database_feature_blocks_size();
+
+	db.features.resize(db.nframes(), nfeatures);
+	db.features_offset.resize(nfeatures);
+	db.features_scale.resize(nfeatures);
+
+	// Forward kinematics is done once per frame into buffers reused
+	// for every frame of a chunk, which all bone features read from
+	database_build_chunks(pool, db.nframes(), [&](int, int start, int stop)
+	{
+		array1d<vec3> global_bone_positions(db.nbones());
+		array1d<vec3> global_bone_velocities(db.nbones());
+		array1d<quat> global_bone_rotations(db.nbones());
+		array1d<vec3> global_bone_angular_velocities(db.nbones());
+
+		for (int i = start; i < stop; i++)
+		{
+			forward_kinematics_velocity_full(
+				global_bone_positions,
+				global_bone_velocities,
+				global_bone_rotations,
+				global_bone_angular_velocities,
+				db.bone_positions(i),
+				db.bone_velocities(i),
+				db.bone_rotations(i),
+				db.bone_angular_velocities(i),
+				db.bone_parents);
+
+			int offset = 0;
+			compute_bone_position_feature(db, offset, i, Bone_LeftFoot, global_bone_positions);
+			compute_bone_position_feature(db, offset, i, Bone_RightFoot, global_bone_positions);
+			compute_bone_velocity_feature(db, offset, i, Bone_LeftFoot, global_bone_velocities);
+			compute_bone_velocity_feature(db, offset, i, Bone_RightFoot, global_bone_velocities);
+			compute_bone_velocity_feature(db, offset, i, Bone_Hips, global_bone_velocities);
+			compute_trajectory_position_feature(db, offset, i);
+			compute_trajectory_direction_feature(db, offset, i);
+
+			assert(offset == nfeatures);
+		}
+	});
+
+	db.features_weight.resize(nfeatures);
+	database_feature_weights(
+		db.features_weight,
+		feature_weight_foot_position,
+		feature_weight_foot_velocity,
+		feature_weight_hip_velocity,
+		feature_weight_trajectory_positions,
+		feature_weight_trajectory_directions);
+
+	// Each block is normalized as a whole and then weighted
+	int offset = 0;
+	for (int b = 0; b < database_feature_nblocks; b++)
+	{
+		normalize_feature(
+			db.features,
+			db.features_offset,
+			db.features_scale,
+			offset,
+			database_feature_blocks[b].size,
+			db.features_weight(offset),
+			pool);
+
+		offset += database_feature_blocks[b].size;
+	}
+
+	database_build_search_features(db);
+	database_build_bounds(db, pool);
+	database_build_kdtree(db);
+	database_build_pca(db);
+}
+
+void database_set_feature_weights(
+	database& db,
+	const float feature_weight_foot_position,
+	const float feature_weight_foot_velocity,
+	const float feature_weight_hip_velocity,
+	const float feature_weight_trajectory_positions,
+	const float feature_weight_trajectory_directions,
+	thread_pool* pool)
+{
+	assert(db.features_weight.size == db.nfeatures());
+
+	array1d<float> weights(db.nfeatures());
+	database_feature_weights(
+		weights,
+		feature_weight_foot_position,
+		feature_weight_foot_velocity,
+		feature_weight_hip_velocity,
+		feature_weight_trajectory_positions,
+		feature_weight_trajectory_directions);
+
+	// Ratio of the new to the old weight for each dimension of 
+	// `features`, and the same in the order of the search features.
+	// Padding always stays zero so keeps a ratio of one.
+	array1d<float> ratio(db.nfeatures());
+	array1d<float> search_ratio(db.nfeatures_padded());
+	search_ratio.set(1.0f);
+
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		assert(weights(j) > 0.0f);
+		ratio(j) = weights(j) / db.features_weight(j);
+		db.features_scale(j) = db.features_scale(j) / ratio(j);
+		db.features_weight(j) = weights(j);
+	}
+
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		search_ratio(j) = ratio(db.search_features_order(j));
+	}
+
+	database_build_chunks(pool, db.nframes(), [&](int, int start, int stop)
+	{
+		for (int i = start; i < stop; i++)
+		{
+			int i_sm = i / BOUND_SM_SIZE;
+			int k = i % BOUND_SM_SIZE;
+
+			for (int j = 0; j < db.nfeatures(); j++)
+			{
+				db.features(i, j) *= ratio(j);
+				db.search_features(i, j) *= search_ratio(j);
+				db.search_features_blocked(i_sm, j * BOUND_SM_SIZE + k) *= search_ratio(j);
+			}
+		}
+	});
+
+	// Scaling by a positive value keeps the order of values so 
+	// the bounds stay tight and the quantized codes stay the same
+	for (int b = 0; b < db.bound_sm_min.rows; b++)
+	{
+		for (int j = 0; j < db.nfeatures(); j++)
+		{
+			db.bound_sm_min(b, j) *= search_ratio(j);
+			db.bound_sm_max(b, j) *= search_ratio(j);
+		}
+	}
+
+	for (int b = 0; b < db.bound_lr_min.rows; b++)
+	{
+		for (int j = 0; j < db.nfeatures(); j++)
+		{
+			db.bound_lr_min(b, j) *= search_ratio(j);
+			db.bound_lr_max(b, j) *= search_ratio(j);
+		}
+	}
+
+	for (int n = 0; n < db.kdtree_bound_min.rows; n++)
+	{
+		for (int j = 0; j < db.nfeatures(); j++)
+		{
+			db.kdtree_bound_min(n, j) *= search_ratio(j);
+			db.kdtree_bound_max(n, j) *= search_ratio(j);
+		}
+	}
+
+	for (int l = 0; l < db.kdtree_features_blocked.rows; l++)
+	{
+		for (int j = 0; j < db.nfeatures(); j++)
+		{
+			for (int k = 0; k < BOUND_SM_SIZE; k++)
+			{
+				db.kdtree_features_blocked(l, j * BOUND_SM_SIZE + k) *= search_ratio(j);
+			}
+		}
+	}
+
+	for (int j = 0; j < db.nfeatures(); j++)
+	{
+		db.search_features_quantized_offset(j) *= search_ratio(j);
+		db.search_features_quantized_scale(j) *= search_ratio(j);
+	}
+
+	// Scaling the dimensions scales the mean and covariance in
+	// the same way but the principal components need recomputing
+	for (int j0 = 0; j0 < db.nfeatures(); j0++)
+	{
+		db.pca_mean(j0) *= search_ratio(j0);
+
+		for (int j1 = 0; j1 < db.nfeatures(); j1++)
+		{
+			db.pca_covariance(j0, j1) *= (double)search_ratio(j0) * search_ratio(j1);
+		}
+	}
+
+	database_build_pca_components(db, pool);
+}
+
+//--------------------------------------
+
+// The search itself is written once and instanced for each 
+// kernel. It only considers frames inside the window 
+// [window_start, window_stop) which should be aligned to 
+// BOUND_LR_SIZE. When `shared_best` is given it is used as an
+// additional bound for pruning, but only for costs strictly 
+// greater than it, so that ties are resolved the same way as
+// a search over the whole database would.
+template<typename K>
+static void motion_matching_search_window(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	const int curr_index,
+	const int window_start,
+	const int window_stop,
+	std::atomic<float>* shared_best,
+	search_stats* stats,
+	const slice1d<uint64_t> frame_tags = slice1d<uint64_t>(0, nullptr),
+	const slice1d<uint64_t> bound_sm_tags_or = slice1d<uint64_t>(0, nullptr),
+	const slice1d<uint64_t> bound_sm_tags_and = slice1d<uint64_t>(0, nullptr),
+	const slice1d<uint64_t> bound_lr_tags_or = slice1d<uint64_t>(0, nullptr),
+	const slice1d<uint64_t> bound_lr_tags_and = slice1d<uint64_t>(0, nullptr),
+	const uint64_t required_tags = 0,
+	const uint64_t excluded_tags = 0)
+{
+	int nfeatures = query_normalized.size;
+	int nranges = range_starts.size;
+	bool tagged = required_tags != 0 || excluded_tags != 0;
+
+	float curr_cost = 0.0f;
+	float bound_cost = 0.0f;
+	float block_costs[BOUND_SM_SIZE];
+
+	// Search rest of database
+	for (int r = 0; r < nranges; r++)
+	{
+		// Exclude end of ranges from search    
+		int i = range_starts(r) > window_start ? range_starts(r) : window_start;
+		int range_end = range_stops(r) - ignore_range_end;
+		range_end = range_end < window_stop ? range_end : window_stop;
+
+		while (i < range_end)
+		{
+			bound_cost = shared_best ? minf(best_cost, nextafterf(shared_best->load(std::memory_order_relaxed), FLT_MAX)) : best_cost;
+
+			// Find index of current and next large box
+			int i_lr = i / BOUND_LR_SIZE;
+			int i_lr_next = (i_lr + 1) * BOUND_LR_SIZE;
+
+			// Skip box if no frame inside can have the right tags
+			if (tagged && !search_tags_match_box(bound_lr_tags_or(i_lr), bound_lr_tags_and(i_lr), required_tags, excluded_tags))
+			{
+				if (stats) { stats->boxes_tested++; stats->boxes_pruned++; }
+				i = i_lr_next;
+				continue;
+			}
+
+			// Find distance to box
+			curr_cost = K::box_cost(
+				query_normalized.data,
+				bound_lr_min(i_lr).data,
+				bound_lr_max(i_lr).data,
+				nfeatures,
+				transition_cost,
+				bound_cost);
+
+			if (stats) { stats->boxes_tested++; }
+
+			// If distance is greater than current best jump to next box
+			if (curr_cost >= bound_cost)
+			{
+				if (stats) { stats->boxes_pruned++; }
+				i = i_lr_next;
+				continue;
+			}
+
+			// Check against small box
+			while (i < i_lr_next && i < range_end)
+			{
+				bound_cost = shared_best ? minf(best_cost, nextafterf(shared_best->load(std::memory_order_relaxed), FLT_MAX)) : best_cost;
+
+				// Find index of current and next small box
+				int i_sm = i / BOUND_SM_SIZE;
+				int i_sm_next = (i_sm + 1) * BOUND_SM_SIZE;
+
+				if (tagged && !search_tags_match_box(bound_sm_tags_or(i_sm), bound_sm_tags_and(i_sm), required_tags, excluded_tags))
+				{
+					if (stats) { stats->boxes_tested++; stats->boxes_pruned++; }
+					i = i_sm_next;
+					continue;
+				}
+
+				// Find distance to box
+				curr_cost = K::box_cost(
+					query_normalized.data,
+					bound_sm_min(i_sm).data,
+					bound_sm_max(i_sm).data,
+					nfeatures,
+					transition_cost,
+					bound_cost);
+
+				if (stats) { stats->boxes_tested++; }
+
+				// If distance is greater than current best jump to next box
+				if (curr_cost >= bound_cost)
+				{
+					if (stats) { stats->boxes_pruned++; }
+					i = i_sm_next;
+					continue;
+				}
+
+				// Check against all frames inside small box at once
+				K::block_cost(
+					block_costs,
+					query_normalized.data,
+					features_blocked(i_sm).data,
+					nfeatures,
+					transition_cost,
+					bound_cost);
+
+				// Search inside small box
+				while (i < i_sm_next && i < range_end)
+				{
+					// Skip surrounding frames
+					if (curr_index != -1 && abs(i - curr_index) < ignore_surrounding)
+					{
+						i++;
+						continue;
+					}
+
+					// Skip frames without the right tags
+					if (tagged && !search_tags_match(frame_tags(i), required_tags, excluded_tags))
+					{
+						i++;
+						continue;
+					}
+
+					if (stats) { stats->frames_tested++; }
+
+					// If cost is lower than current best then update best
+					curr_cost = block_costs[i - i_sm * BOUND_SM_SIZE];
+					if (curr_cost < best_cost)
+					{
+						best_index = i;
+						best_cost = curr_cost;
+					}
+
+					i++;
+				}
+
+				// Let the other searches know about our new best
+				if (shared_best && best_cost < bound_cost)
+				{
+					float prev = shared_best->load(std::memory_order_relaxed);
+					while (best_cost < prev && !shared_best->compare_exchange_weak(prev, best_cost, std::memory_order_relaxed)) {}
+				}
+			}
+		}
+	}
+}
+
+// Cost of the current frame, computed using the same 
+// kernel as the rest of the search
+static float motion_matching_search_current_cost(
+	const slice2d<float> features,
+	const slice1d<float> query_normalized,
+	const int curr_index)
+{
+	float cost = FLT_MAX;
+	
+	search_kernel_dispatch([&](auto kernel)
+	{
+		cost = decltype(kernel)::frame_cost(
+			query_normalized.data,
+			features(curr_index).data,
+			query_normalized.size,
+			0.0f,
+			FLT_MAX);
+	});
+
+	return cost;
+}
+
+// Motion Matching search function essentially consists
 // of comparing every feature vector in the database, 
 // against the query feature vector, first checking the 
 // query distance to the axis aligned bounding boxes used 
@@ -526,9 +1966,1132 @@ void motion_matching_search(
 	float& RESTRICT best_cost,
 	const slice1d<int> range_starts,
 	const slice1d<int> range_stops,
-	const slice2d<float> features,
-	const slice1d<float> features_offset,
-	const slice1d<float> features_scale,
+	const slice2d<float> features,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	int curr_index = best_index;
+
+	// Find cost for current frame
+	if (best_index != -1)
+	{
+		best_cost = motion_matching_search_current_cost(features, query_normalized, curr_index);
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_window<decltype(kernel)>(
+			best_index,
+			best_cost,
+			range_starts,
+			range_stops,
+			features_blocked,
+			bound_sm_min,
+			bound_sm_max,
+			bound_lr_min,
+			bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			0,
+			features.rows,
+			nullptr,
+			stats);
+	});
+}
+
+// Same as above but the database is split into spans of 
+// large boxes which are searched in parallel. Each task 
+// keeps track of its own best and the best across all tasks
+// is shared so all of them can prune more. The result is the
+// same as `motion_matching_search`.
+void motion_matching_search_parallel(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	thread_pool& pool,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding)
+{
+	int curr_index = best_index;
+
+	// Find cost for current frame
+	if (best_index != -1)
+	{
+		best_cost = motion_matching_search_current_cost(features, query_normalized, curr_index);
+	}
+
+	// Nothing to split between tasks
+	if (features.rows == 0) { return; }
+
+	// Use a few tasks per thread to balance the load
+	int ntasks = pool.nthreads() * SEARCH_TASKS_PER_THREAD;
+	int span = ((bound_lr_min.rows + ntasks - 1) / ntasks) * BOUND_LR_SIZE;
+	ntasks = (features.rows + span - 1) / span;
+
+	array1d<int> task_best_index(ntasks);
+	array1d<float> task_best_cost(ntasks);
+	std::atomic<float> shared_best(best_cost);
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		thread_pool_run(pool, ntasks, [&](int task, int)
+		{
+			task_best_index(task) = -1;
+			task_best_cost(task) = best_cost;
+
+			motion_matching_search_window<decltype(kernel)>(
+				task_best_index(task),
+				task_best_cost(task),
+				range_starts,
+				range_stops,
+				features_blocked,
+				bound_sm_min,
+				bound_sm_max,
+				bound_lr_min,
+				bound_lr_max,
+				query_normalized,
+				transition_cost,
+				ignore_range_end,
+				ignore_surrounding,
+				curr_index,
+				task * span,
+				(task + 1) * span,
+				&shared_best,
+				nullptr);
+		});
+	});
+
+	// Tasks are in database order so taking the first of 
+	// any equal costs gives the same result as the serial
+	// search
+	for (int t = 0; t < ntasks; t++)
+	{
+		if (task_best_index(t) != -1 && task_best_cost(t) < best_cost)
+		{
+			best_index = task_best_index(t);
+			best_cost = task_best_cost(t);
+		}
+	}
+}
+
+// Search using the KD-tree. Since the order in which frames
+// are visited is not the database order, ties are explicitly
+// resolved in favour of the lowest frame index, and once some
+// frame has been found we only prune things strictly worse
+// than it, so the result matches the other searches exactly.
+template<typename K>
+static void motion_matching_search_kdtree_kernel(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> kdtree_left,
+	const slice1d<int> kdtree_right,
+	const slice1d<int> kdtree_leaf,
+	const slice2d<float> kdtree_bound_min,
+	const slice2d<float> kdtree_bound_max,
+	const slice2d<float> kdtree_features_blocked,
+	const slice2d<int> kdtree_frames,
+	const slice2d<int> kdtree_range_stops,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	const int curr_index,
+	search_stats* stats)
+{
+	int nfeatures = query_normalized.size;
+
+	bool found = false;
+	float block_costs[BOUND_SM_SIZE];
+
+	// Stack of nodes to visit and their distance
+	int stack_nodes[KDTREE_STACK_SIZE];
+	float stack_costs[KDTREE_STACK_SIZE];
+	int stack_size = 0;
+
+	stack_nodes[stack_size] = 0;
+	stack_costs[stack_size] = 0.0f;
+	stack_size++;
+
+	while (stack_size > 0)
+	{
+		stack_size--;
+		int node = stack_nodes[stack_size];
+		float bound_cost = found ? nextafterf(best_cost, FLT_MAX) : best_cost;
+
+		// Best may have improved since this node was pushed
+		if (stack_costs[stack_size] >= bound_cost)
+		{
+			if (stats) { stats->boxes_pruned++; }
+			continue;
+		}
+
+		if (kdtree_leaf(node) != -1)
+		{
+			int leaf = kdtree_leaf(node);
+
+			K::block_cost(
+				block_costs,
+				query_normalized.data,
+				kdtree_features_blocked(leaf).data,
+				nfeatures,
+				transition_cost,
+				bound_cost);
+
+			for (int k = 0; k < BOUND_SM_SIZE; k++)
+			{
+				int i = kdtree_frames(leaf, k);
+
+				// Skip unused slots and the end of ranges
+				if (i == -1 || i >= kdtree_range_stops(leaf, k) - ignore_range_end)
+				{
+					continue;
+				}
+
+				// Skip surrounding frames
+				if (curr_index != -1 && abs(i - curr_index) < ignore_surrounding)
+				{
+					continue;
+				}
+
+				if (stats) { stats->frames_tested++; }
+
+				float curr_cost = block_costs[k];
+				if (curr_cost < best_cost || (found && curr_cost == best_cost && i < best_index))
+				{
+					best_index = i;
+					best_cost = curr_cost;
+					found = true;
+				}
+			}
+
+			continue;
+		}
+
+		// Find distance to both children
+		int node_left = kdtree_left(node);
+		int node_right = kdtree_right(node);
+
+		float cost_left = K::box_cost(
+			query_normalized.data,
+			kdtree_bound_min(node_left).data,
+			kdtree_bound_max(node_left).data,
+			nfeatures,
+			transition_cost,
+			bound_cost);
+
+		float cost_right = K::box_cost(
+			query_normalized.data,
+			kdtree_bound_min(node_right).data,
+			kdtree_bound_max(node_right).data,
+			nfeatures,
+			transition_cost,
+			bound_cost);
+
+		if (stats) { stats->boxes_tested += 2; }
+
+		// Push furthest first so nearest is visited next
+		int node_near = cost_left <= cost_right ? node_left : node_right;
+		int node_far = cost_left <= cost_right ? node_right : node_left;
+		float cost_near = minf(cost_left, cost_right);
+		float cost_far = maxf(cost_left, cost_right);
+
+		assert(stack_size + 2 <= KDTREE_STACK_SIZE);
+
+		if (cost_far < bound_cost)
+		{
+			stack_nodes[stack_size] = node_far;
+			stack_costs[stack_size] = cost_far;
+			stack_size++;
+		}
+		else if (stats)
+		{
+			stats->boxes_pruned++;
+		}
+
+		if (cost_near < bound_cost)
+		{
+			stack_nodes[stack_size] = node_near;
+			stack_costs[stack_size] = cost_near;
+			stack_size++;
+		}
+		else if (stats)
+		{
+			stats->boxes_pruned++;
+		}
+	}
+}
+
+void motion_matching_search_kdtree(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice2d<float> features,
+	const slice1d<int> kdtree_left,
+	const slice1d<int> kdtree_right,
+	const slice1d<int> kdtree_leaf,
+	const slice2d<float> kdtree_bound_min,
+	const slice2d<float> kdtree_bound_max,
+	const slice2d<float> kdtree_features_blocked,
+	const slice2d<int> kdtree_frames,
+	const slice2d<int> kdtree_range_stops,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	int curr_index = best_index;
+
+	// Find cost for current frame
+	if (best_index != -1)
+	{
+		best_cost = motion_matching_search_current_cost(features, query_normalized, curr_index);
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_kdtree_kernel<decltype(kernel)>(
+			best_index,
+			best_cost,
+			kdtree_left,
+			kdtree_right,
+			kdtree_leaf,
+			kdtree_bound_min,
+			kdtree_bound_max,
+			kdtree_features_blocked,
+			kdtree_frames,
+			kdtree_range_stops,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			stats);
+	});
+}
+
+template<typename K>
+static void motion_matching_search_quantized_kernel(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<signed char> features_quantized,
+	const slice1d<float> features_quantized_offset,
+	const slice1d<float> features_quantized_scale,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	const int curr_index,
+	const int nrerank,
+	search_stats* stats)
+{
+	int nfeatures = query_normalized.size;
+
+	// Candidates are kept sorted by their coarse cost
+	float candidate_costs[SEARCH_RERANK_MAX];
+	int candidate_indices[SEARCH_RERANK_MAX];
+	int ncandidates = 0;
+
+	for (int r = 0; r < range_starts.size; r++)
+	{
+		int i = range_starts(r);
+		int range_end = range_stops(r) - ignore_range_end;
+
+		while (i < range_end)
+		{
+			// Boxes are only skipped if they cannot beat the current 
+			// frame or (approximately) the worst of the candidates
+			float bound_cost = ncandidates == nrerank ? 
+				minf(best_cost, candidate_costs[nrerank - 1] + transition_cost) : best_cost;
+
+			int i_lr = i / BOUND_LR_SIZE;
+			int i_lr_next = (i_lr + 1) * BOUND_LR_SIZE;
+
+			float curr_cost = K::box_cost(
+				query_normalized.data,
+				bound_lr_min(i_lr).data,
+				bound_lr_max(i_lr).data,
+				nfeatures,
+				transition_cost,
+				bound_cost);
+
+			if (stats) { stats->boxes_tested++; }
+
+			if (curr_cost >= bound_cost)
+			{
+				if (stats) { stats->boxes_pruned++; }
+				i = i_lr_next;
+				continue;
+			}
+
+			while (i < i_lr_next && i < range_end)
+			{
+				bound_cost = ncandidates == nrerank ? 
+					minf(best_cost, candidate_costs[nrerank - 1] + transition_cost) : best_cost;
+
+				int i_sm = i / BOUND_SM_SIZE;
+				int i_sm_next = (i_sm + 1) * BOUND_SM_SIZE;
+
+				curr_cost = K::box_cost(
+					query_normalized.data,
+					bound_sm_min(i_sm).data,
+					bound_sm_max(i_sm).data,
+					nfeatures,
+					transition_cost,
+					bound_cost);
+
+				if (stats) { stats->boxes_tested++; }
+
+				if (curr_cost >= bound_cost)
+				{
+					if (stats) { stats->boxes_pruned++; }
+					i = i_sm_next;
+					continue;
+				}
+
+				// Coarse pass over frames in the small box
+				while (i < i_sm_next && i < range_end)
+				{
+					// Skip surrounding frames
+					if (curr_index != -1 && abs(i - curr_index) < ignore_surrounding)
+					{
+						i++;
+						continue;
+					}
+
+					if (stats) { stats->frames_tested++; }
+
+					float candidate_bound = ncandidates == nrerank ? candidate_costs[nrerank - 1] : FLT_MAX;
+
+					curr_cost = K::quantized_cost(
+						query_normalized.data,
+						features_quantized(i).data,
+						features_quantized_offset.data,
+						features_quantized_scale.data,
+						nfeatures,
+						0.0f,
+						candidate_bound);
+
+					// Insert into the sorted candidates, dropping the worst
+					if (curr_cost < candidate_bound)
+					{
+						int k = ncandidates < nrerank ? ncandidates++ : nrerank - 1;
+						while (k > 0 && candidate_costs[k - 1] > curr_cost)
+						{
+							candidate_costs[k] = candidate_costs[k - 1];
+							candidate_indices[k] = candidate_indices[k - 1];
+							k--;
+						}
+
+						candidate_costs[k] = curr_cost;
+						candidate_indices[k] = i;
+					}
+
+					i++;
+				}
+			}
+		}
+	}
+
+	// Re-rank candidates using the full precision features,
+	// resolving ties the same way as the exact search
+	bool found = false;
+
+	for (int k = 0; k < ncandidates; k++)
+	{
+		int i = candidate_indices[k];
+
+		float cost = K::frame_cost(
+			query_normalized.data,
+			features(i).data,
+			query_normalized.size,
+			transition_cost,
+			found ? nextafterf(best_cost, FLT_MAX) : best_cost);
+
+		if (cost < best_cost || (found && cost == best_cost && i < best_index))
+		{
+			best_index = i;
+			best_cost = cost;
+			found = true;
+		}
+	}
+
+	if (stats) { stats->frames_tested += ncandidates; }
+}
+
+// Coarse pass over the quantized features, still using the
+// bounds to skip boxes, followed by a re-rank of the best 
+// candidates
+void motion_matching_search_quantized(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<signed char> features_quantized,
+	const slice1d<float> features_quantized_offset,
+	const slice1d<float> features_quantized_scale,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	const int nrerank,
+	search_stats* stats)
+{
+	assert(nrerank > 0 && nrerank <= SEARCH_RERANK_MAX);
+
+	int curr_index = best_index;
+
+	// Find cost for current frame
+	if (best_index != -1)
+	{
+		best_cost = motion_matching_search_current_cost(features, query_normalized, curr_index);
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_quantized_kernel<decltype(kernel)>(
+			best_index,
+			best_cost,
+			range_starts,
+			range_stops,
+			features,
+			features_quantized,
+			features_quantized_offset,
+			features_quantized_scale,
+			bound_sm_min,
+			bound_sm_max,
+			bound_lr_min,
+			bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			nrerank,
+			stats);
+	});
+}
+
+template<typename K>
+static void motion_matching_search_pca_kernel(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice2d<float> pca_projections,
+	const slice1d<float> pca_norms,
+	const slice1d<float> query_normalized,
+	const slice1d<float> query_projection,
+	const float query_norm,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	const int curr_index,
+	search_stats* stats)
+{
+	int nfeatures = query_normalized.size;
+
+	// Each projected component is a dot product of `nfeatures`
+	// terms so has a rounding error of at most around 
+	// `nfeatures * FLT_EPSILON / 2` times the distance from the 
+	// mean, and rounding the basis to float adds at most the same
+	// again. Over PCA_COMPONENTS components that bounds the error
+	// in the distance between two projections by `pca_epsilon` 
+	// times the distance of the query and frame from the mean.
+	// The relative rounding of summing the full cost is covered 
+	// by `pca_relative`. Both have a factor of two to spare.
+	const float pca_epsilon = 2.0f * sqrtf((float)PCA_COMPONENTS) * (nfeatures + 1) * FLT_EPSILON;
+	const float pca_relative = 1.0f - 2.0f * (nfeatures + PCA_COMPONENTS + 2) * FLT_EPSILON;
+
+	for (int r = 0; r < range_starts.size; r++)
+	{
+		int i = range_starts(r);
+		int range_end = range_stops(r) - ignore_range_end;
+
+		while (i < range_end)
+		{
+			int i_lr = i / BOUND_LR_SIZE;
+			int i_lr_next = (i_lr + 1) * BOUND_LR_SIZE;
+
+			float curr_cost = K::box_cost(
+				query_normalized.data,
+				bound_lr_min(i_lr).data,
+				bound_lr_max(i_lr).data,
+				nfeatures,
+				transition_cost,
+				best_cost);
+
+			if (stats) { stats->boxes_tested++; }
+
+			if (curr_cost >= best_cost)
+			{
+				if (stats) { stats->boxes_pruned++; }
+				i = i_lr_next;
+				continue;
+			}
+
+			while (i < i_lr_next && i < range_end)
+			{
+				int i_sm = i / BOUND_SM_SIZE;
+				int i_sm_next = (i_sm + 1) * BOUND_SM_SIZE;
+
+				curr_cost = K::box_cost(
+					query_normalized.data,
+					bound_sm_min(i_sm).data,
+					bound_sm_max(i_sm).data,
+					nfeatures,
+					transition_cost,
+					best_cost);
+
+				if (stats) { stats->boxes_tested++; }
+
+				if (curr_cost >= best_cost)
+				{
+					if (stats) { stats->boxes_pruned++; }
+					i = i_sm_next;
+					continue;
+				}
+
+				while (i < i_sm_next && i < range_end)
+				{
+					// Skip surrounding frames
+					if (curr_index != -1 && abs(i - curr_index) < ignore_surrounding)
+					{
+						i++;
+						continue;
+					}
+
+					// Lower bound on the distance from the projections, 
+					// loosened by the rounding error of the projections
+					float lower_bound = sqrtf(K::frame_cost(
+						query_projection.data,
+						pca_projections(i).data,
+						PCA_COMPONENTS,
+						0.0f,
+						FLT_MAX)) - pca_epsilon * (query_norm + pca_norms(i));
+
+					if (lower_bound > 0.0f &&
+						(squaref(lower_bound) + transition_cost) * pca_relative >= best_cost)
+					{
+						if (stats) { stats->frames_prefiltered++; }
+						i++;
+						continue;
+					}
+
+					if (stats) { stats->frames_tested++; }
+
+					// Full cost accumulated in the same order as the
+					// blocked search so the result is identical
+					curr_cost = search_kernel_scalar::frame_cost(
+						query_normalized.data,
+						features(i).data,
+						nfeatures,
+						transition_cost,
+						best_cost);
+
+					if (curr_cost < best_cost)
+					{
+						best_index = i;
+						best_cost = curr_cost;
+					}
+
+					i++;
+				}
+			}
+		}
+	}
+}
+
+// Bounds search with a lower bound computed from the 
+// PCA projections used to skip most frames
+void motion_matching_search_pca(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice2d<float> pca_projections,
+	const slice1d<float> pca_norms,
+	const slice1d<float> query_normalized,
+	const slice1d<float> query_projection,
+	const float query_norm,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	int curr_index = best_index;
+
+	// Find cost for current frame
+	if (best_index != -1)
+	{
+		best_cost = motion_matching_search_current_cost(features, query_normalized, curr_index);
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_pca_kernel<decltype(kernel)>(
+			best_index,
+			best_cost,
+			range_starts,
+			range_stops,
+			features,
+			bound_sm_min,
+			bound_sm_max,
+			bound_lr_min,
+			bound_lr_max,
+			pca_projections,
+			pca_norms,
+			query_normalized,
+			query_projection,
+			query_norm,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			stats);
+	});
+}
+
+// Searches for the best match of many queries at once. 
+// Rather than searching the whole database once per query 
+// the boxes are walked a single time and every query still 
+// live is tested against each one, so each box's features 
+// are only brought into cache once per batch. Each query 
+// gives the same result as `motion_matching_search`.
+template<typename K>
+static void motion_matching_search_batch_kernel(
+	slice1d<int> best_indices,
+	slice1d<float> best_costs,
+	slice1d<int> curr_indices,
+	slice1d<int> lr_live,
+	slice1d<int> sm_live,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice2d<float> queries_normalized,
+	const slice1d<float> transition_costs,
+	const slice1d<int> ignore_range_ends,
+	const slice1d<int> ignore_surroundings)
+{
+	int nqueries = queries_normalized.rows;
+	int nfeatures = queries_normalized.cols;
+	int nranges = range_starts.size;
+
+	// The walk needs to go as far as the query 
+	// ignoring the least of the range end
+	int ignore_range_end_min = INT_MAX;
+	for (int q = 0; q < nqueries; q++)
+	{
+		ignore_range_end_min = ignore_range_ends(q) < ignore_range_end_min ? ignore_range_ends(q) : ignore_range_end_min;
+	}
+
+	float block_costs[BOUND_SM_SIZE];
+
+	for (int r = 0; r < nranges; r++)
+	{
+		int i = range_starts(r);
+		int range_end = range_stops(r) - ignore_range_end_min;
+
+		while (i < range_end)
+		{
+			int i_lr = i / BOUND_LR_SIZE;
+			int i_lr_next = (i_lr + 1) * BOUND_LR_SIZE;
+
+			// Find the queries which are not pruned by the large box
+			int nlr_live = 0;
+			for (int q = 0; q < nqueries; q++)
+			{
+				if (i >= range_stops(r) - ignore_range_ends(q))
+				{
+					continue;
+				}
+
+				float curr_cost = K::box_cost(
+					queries_normalized(q).data,
+					bound_lr_min(i_lr).data,
+					bound_lr_max(i_lr).data,
+					nfeatures,
+					transition_costs(q),
+					best_costs(q));
+
+				if (curr_cost < best_costs(q))
+				{
+					lr_live(nlr_live++) = q;
+				}
+			}
+
+			if (nlr_live == 0)
+			{
+				i = i_lr_next;
+				continue;
+			}
+
+			// Check against small boxes
+			while (i < i_lr_next && i < range_end)
+			{
+				int i_sm = i / BOUND_SM_SIZE;
+				int i_sm_next = (i_sm + 1) * BOUND_SM_SIZE;
+
+				int nsm_live = 0;
+				for (int l = 0; l < nlr_live; l++)
+				{
+					int q = lr_live(l);
+
+					if (i >= range_stops(r) - ignore_range_ends(q))
+					{
+						continue;
+					}
+
+					float curr_cost = K::box_cost(
+						queries_normalized(q).data,
+						bound_sm_min(i_sm).data,
+						bound_sm_max(i_sm).data,
+						nfeatures,
+						transition_costs(q),
+						best_costs(q));
+
+					if (curr_cost < best_costs(q))
+					{
+						sm_live(nsm_live++) = q;
+					}
+				}
+
+				// Search inside small box for each live query
+				for (int l = 0; l < nsm_live; l++)
+				{
+					int q = sm_live(l);
+					int q_range_end = range_stops(r) - ignore_range_ends(q);
+
+					K::block_cost(
+						block_costs,
+						queries_normalized(q).data,
+						features_blocked(i_sm).data,
+						nfeatures,
+						transition_costs(q),
+						best_costs(q));
+
+					for (int j = i; j < i_sm_next && j < q_range_end; j++)
+					{
+						// Skip surrounding frames
+						if (curr_indices(q) != -1 && abs(j - curr_indices(q)) < ignore_surroundings(q))
+						{
+							continue;
+						}
+
+						float curr_cost = block_costs[j - i_sm * BOUND_SM_SIZE];
+						if (curr_cost < best_costs(q))
+						{
+							best_indices(q) = j;
+							best_costs(q) = curr_cost;
+						}
+					}
+				}
+
+				i = i_sm_next;
+			}
+		}
+	}
+}
+
+void motion_matching_search_batch(
+	slice1d<int> best_indices,
+	slice1d<float> best_costs,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice2d<float> queries_normalized,
+	const slice1d<float> transition_costs,
+	const slice1d<int> ignore_range_ends,
+	const slice1d<int> ignore_surroundings)
+{
+	int nqueries = queries_normalized.rows;
+
+	array1d<int> curr_indices(nqueries);
+	array1d<int> lr_live(nqueries);
+	array1d<int> sm_live(nqueries);
+
+	// Find cost for current frames
+	for (int q = 0; q < nqueries; q++)
+	{
+		curr_indices(q) = best_indices(q);
+
+		if (best_indices(q) != -1)
+		{
+			best_costs(q) = motion_matching_search_current_cost(features, queries_normalized(q), best_indices(q));
+		}
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_batch_kernel<decltype(kernel)>(
+			best_indices,
+			best_costs,
+			curr_indices,
+			lr_live,
+			sm_live,
+			range_starts,
+			range_stops,
+			features_blocked,
+			bound_sm_min,
+			bound_sm_max,
+			bound_lr_min,
+			bound_lr_max,
+			queries_normalized,
+			transition_costs,
+			ignore_range_ends,
+			ignore_surroundings);
+	});
+}
+
+// Normalize a query and put it in the same order as the 
+// search features, leaving the padding as zero
+void database_query_normalize(
+	slice1d<float> query_normalized,
+	const database& db,
+	const slice1d<float> query)
+{
+	query_normalized.zero();
+	for (int i = 0; i < db.nfeatures(); i++)
+	{
+		int j = db.search_features_order(i);
+		query_normalized(i) = (query(j) - db.features_offset(j)) / db.features_scale(j);
+	}
+}
+
+// Search database using the given acceleration structure
+void database_search(
+	int& best_index,
+	float& best_cost,
+	const database& db,
+	const slice1d<float> query,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	const int search_mode,
+	search_stats* stats)
+{
+	// Normalize Query
+	array1d<float> query_normalized(db.nfeatures_padded());
+	database_query_normalize(query_normalized, db, query);
+
+	// Search
+	if (search_mode == SEARCH_MODE_KDTREE)
+	{
+		motion_matching_search_kdtree(
+			best_index,
+			best_cost,
+			db.search_features,
+			db.kdtree_left,
+			db.kdtree_right,
+			db.kdtree_leaf,
+			db.kdtree_bound_min,
+			db.kdtree_bound_max,
+			db.kdtree_features_blocked,
+			db.kdtree_frames,
+			db.kdtree_range_stops,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			stats);
+	}
+	else if (search_mode == SEARCH_MODE_PCA)
+	{
+		array1d<float> query_projection(PCA_COMPONENTS);
+		float query_norm = pca_project(query_projection, db.pca_basis, db.pca_mean, query_normalized);
+
+		motion_matching_search_pca(
+			best_index,
+			best_cost,
+			db.range_starts,
+			db.range_stops,
+			db.search_features,
+			db.bound_sm_min,
+			db.bound_sm_max,
+			db.bound_lr_min,
+			db.bound_lr_max,
+			db.pca_projections,
+			db.pca_norms,
+			query_normalized,
+			query_projection,
+			query_norm,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			stats);
+	}
+	else if (search_mode == SEARCH_MODE_QUANTIZED)
+	{
+		motion_matching_search_quantized(
+			best_index,
+			best_cost,
+			db.range_starts,
+			db.range_stops,
+			db.search_features,
+			db.search_features_quantized,
+			db.search_features_quantized_offset,
+			db.search_features_quantized_scale,
+			db.bound_sm_min,
+			db.bound_sm_max,
+			db.bound_lr_min,
+			db.bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			SEARCH_RERANK_SIZE,
+			stats);
+	}
+	else
+	{
+		motion_matching_search(
+			best_index,
+			best_cost,
+			db.range_starts,
+			db.range_stops,
+			db.search_features,
+			db.search_features_blocked,
+			db.bound_sm_min,
+			db.bound_sm_max,
+			db.bound_lr_min,
+			db.bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			stats);
+	}
+}
+
+// Search database in parallel
+void database_search_parallel(
+	int& best_index,
+	float& best_cost,
+	thread_pool& pool,
+	const database& db,
+	const slice1d<float> query,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding)
+{
+	// Normalize Query
+	array1d<float> query_normalized(db.nfeatures_padded());
+	database_query_normalize(query_normalized, db, query);
+
+	// Search
+	motion_matching_search_parallel(
+		best_index,
+		best_cost,
+		pool,
+		db.range_starts,
+		db.range_stops,
+		db.search_features,
+		db.search_features_blocked,
+		db.bound_sm_min,
+		db.bound_sm_max,
+		db.bound_lr_min,
+		db.bound_lr_max,
+		query_normalized,
+		transition_cost,
+		ignore_range_end,
+		ignore_surrounding);
+}
+
+// Search database for many queries at once
+void database_search_batch(
+	slice1d<int> best_indices,
+	slice1d<float> best_costs,
+	const database& db,
+	const slice2d<float> queries,
+	const slice1d<float> transition_costs,
+	const slice1d<int> ignore_range_ends,
+	const slice1d<int> ignore_surroundings)
+{
+	// Normalize Queries
+	array2d<float> queries_normalized(queries.rows, db.nfeatures_padded());
+	for (int q = 0; q < queries.rows; q++)
+	{
+		database_query_normalize(queries_normalized(q), db, queries(q));
+	}
+
+	// Search
+	motion_matching_search_batch(
+		best_indices,
+		best_costs,
+		db.range_starts,
+		db.range_stops,
+		db.search_features,
+		db.search_features_blocked,
+		db.bound_sm_min,
+		db.bound_sm_max,
+		db.bound_lr_min,
+		db.bound_lr_max,
+		queries_normalized,
+		transition_costs,
+		ignore_range_ends,
+		ignore_surroundings);
+}
+
+//--------------------------------------
+
+template<typename K>
+static void motion_matching_search_topk_kernel(
+	std::pair<float, int>* RESTRICT heap,
+	int& RESTRICT nheap,
+	const int k,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features_blocked,
 	const slice2d<float> bound_sm_min,
 	const slice2d<float> bound_sm_max,
 	const slice2d<float> bound_lr_min,
@@ -536,86 +3099,75 @@ void motion_matching_search(
 	const slice1d<float> query_normalized,
 	const float transition_cost,
 	const int ignore_range_end,
-	const int ignore_surrounding)
+	const int ignore_surrounding,
+	const int curr_index,
+	search_stats* stats)
 {
 	int nfeatures = query_normalized.size;
-	int nranges = range_starts.size;
-
-	int curr_index = best_index;
-
-	// Find cost for current frame
-	if (best_index != -1)
-	{
-		best_cost = 0.0;
-		for (int i = 0; i < nfeatures; i++)
-		{
-			best_cost += squaref(query_normalized(i) - features(best_index, i));
-		}
-	}
-
-	float curr_cost = 0.0f;
+	float block_costs[BOUND_SM_SIZE];
 
-	// Search rest of database
-	for (int r = 0; r < nranges; r++)
+	for (int r = 0; r < range_starts.size; r++)
 	{
-		// Exclude end of ranges from search    
 		int i = range_starts(r);
 		int range_end = range_stops(r) - ignore_range_end;
 
 		while (i < range_end)
 		{
-			// Find index of current and next large box
+			// Prune against the K-th best once we have K candidates
+			float bound_cost = nheap == k ? heap[0].first : FLT_MAX;
+
 			int i_lr = i / BOUND_LR_SIZE;
 			int i_lr_next = (i_lr + 1) * BOUND_LR_SIZE;
 
-			// Find distance to box
-			curr_cost = transition_cost;
-			for (int j = 0; j < nfeatures; j++)
-			{
-				curr_cost += squaref(query_normalized(j) - clampf(query_normalized(j),
-					bound_lr_min(i_lr, j), bound_lr_max(i_lr, j)));
+			float curr_cost = K::box_cost(
+				query_normalized.data,
+				bound_lr_min(i_lr).data,
+				bound_lr_max(i_lr).data,
+				nfeatures,
+				transition_cost,
+				bound_cost);
 
-				if (curr_cost >= best_cost)
-				{
-					break;
-				}
-			}
+			if (stats) { stats->boxes_tested++; }
 
-			// If distance is greater than current best jump to next box
-			if (curr_cost >= best_cost)
+			if (curr_cost >= bound_cost)
 			{
+				if (stats) { stats->boxes_pruned++; }
 				i = i_lr_next;
 				continue;
 			}
 
-			// Check against small box
 			while (i < i_lr_next && i < range_end)
 			{
-				// Find index of current and next small box
+				bound_cost = nheap == k ? heap[0].first : FLT_MAX;
+
 				int i_sm = i / BOUND_SM_SIZE;
 				int i_sm_next = (i_sm + 1) * BOUND_SM_SIZE;
 
-				// Find distance to box
-				curr_cost = transition_cost;
-				for (int j = 0; j < nfeatures; j++)
-				{
-					curr_cost += squaref(query_normalized(j) - clampf(query_normalized(j),
-						bound_sm_min(i_sm, j), bound_sm_max(i_sm, j)));
+				curr_cost = K::box_cost(
+					query_normalized.data,
+					bound_sm_min(i_sm).data,
+					bound_sm_max(i_sm).data,
+					nfeatures,
+					transition_cost,
+					bound_cost);
 
-					if (curr_cost >= best_cost)
-					{
-						break;
-					}
-				}
+				if (stats) { stats->boxes_tested++; }
 
-				// If distance is greater than current best jump to next box
-				if (curr_cost >= best_cost)
+				if (curr_cost >= bound_cost)
 				{
+					if (stats) { stats->boxes_pruned++; }
 					i = i_sm_next;
 					continue;
 				}
 
-				// Search inside small box
+				K::block_cost(
+					block_costs,
+					query_normalized.data,
+					features_blocked(i_sm).data,
+					nfeatures,
+					transition_cost,
+					bound_cost);
+
 				while (i < i_sm_next && i < range_end)
 				{
 					// Skip surrounding frames
@@ -625,22 +3177,20 @@ void motion_matching_search(
 						continue;
 					}
 
-					// Check against each frame inside small box
-					curr_cost = transition_cost;
-					for (int j = 0; j < nfeatures; j++)
+					if (stats) { stats->frames_tested++; }
+
+					// Replace the worst candidate if better
+					curr_cost = block_costs[i - i_sm * BOUND_SM_SIZE];
+					if (nheap < k)
 					{
-						curr_cost += squaref(query_normalized(j) - features(i, j));
-						if (curr_cost >= best_cost)
-						{
-							break;
-						}
+						heap[nheap++] = { curr_cost, i };
+						std::push_heap(heap, heap + nheap);
 					}
-
-					// If cost is lower than current best then update best
-					if (curr_cost < best_cost)
+					else if (curr_cost < heap[0].first)
 					{
-						best_index = i;
-						best_cost = curr_cost;
+						std::pop_heap(heap, heap + nheap);
+						heap[nheap - 1] = { curr_cost, i };
+						std::push_heap(heap, heap + nheap);
 					}
 
 					i++;
@@ -650,38 +3200,449 @@ void motion_matching_search(
 	}
 }
 
-// Search database
-void database_search(
+// Same as `motion_matching_search` but keeps the K best
+// frames in a fixed size max-heap, with the worst of them 
+// used for pruning once it is full
+void motion_matching_search_topk(
+	slice1d<int> best_indices,
+	slice1d<float> best_costs,
+	const int curr_index,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	int k = best_indices.size;
+	assert(k > 0 && k <= SEARCH_TOPK_MAX && best_costs.size == k);
+
+	std::pair<float, int> heap[SEARCH_TOPK_MAX];
+	int nheap = 0;
+
+	// Current frame is a candidate like any other
+	if (curr_index != -1)
+	{
+		heap[nheap++] = { motion_matching_search_current_cost(features, query_normalized, curr_index), curr_index };
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_topk_kernel<decltype(kernel)>(
+			heap,
+			nheap,
+			k,
+			range_starts,
+			range_stops,
+			features_blocked,
+			bound_sm_min,
+			bound_sm_max,
+			bound_lr_min,
+			bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			stats);
+	});
+
+	// Sort by cost, and by index for equal costs
+	std::sort_heap(heap, heap + nheap);
+
+	best_indices.set(-1);
+	best_costs.set(FLT_MAX);
+
+	for (int h = 0; h < nheap; h++)
+	{
+		best_indices(h) = heap[h].second;
+		best_costs(h) = heap[h].first;
+	}
+}
+
+// Search database for the K best frames
+void database_search_topk(
+	slice1d<int> best_indices,
+	slice1d<float> best_costs,
+	const database& db,
+	const slice1d<float> query,
+	const int curr_index,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	// Normalize Query
+	array1d<float> query_normalized(db.nfeatures_padded());
+	database_query_normalize(query_normalized, db, query);
+
+	// Search
+	motion_matching_search_topk(
+		best_indices,
+		best_costs,
+		curr_index,
+		db.range_starts,
+		db.range_stops,
+		db.search_features,
+		db.search_features_blocked,
+		db.bound_sm_min,
+		db.bound_sm_max,
+		db.bound_lr_min,
+		db.bound_lr_max,
+		query_normalized,
+		transition_cost,
+		ignore_range_end,
+		ignore_surrounding,
+		stats);
+}
+
+//--------------------------------------
+
+void search_warm_start_advance(search_warm_start& warm_start, const int frames)
+{
+	for (int e = 0; e < warm_start.count; e++)
+	{
+		warm_start.elapsed[e] += frames;
+	}
+}
+
+void search_warm_start_reset(search_warm_start& warm_start)
+{
+	warm_start = search_warm_start();
+}
+
+// Search database, seeding the best cost with the best 
+// successor of the recent winners kept in `warm_start`
+void database_search_warm_start(
 	int& best_index,
 	float& best_cost,
+	search_warm_start& warm_start,
 	const database& db,
 	const slice1d<float> query,
 	const float transition_cost,
 	const int ignore_range_end,
-	const int ignore_surrounding)
+	const int ignore_surrounding,
+	search_stats* stats)
 {
 	// Normalize Query
-	array1d<float> query_normalized(db.nfeatures());
-	for (int i = 0; i < db.nfeatures(); i++)
+	array1d<float> query_normalized(db.nfeatures_padded());
+	database_query_normalize(query_normalized, db, query);
+
+	int curr_index = best_index;
+
+	// Find cost for current frame
+	if (best_index != -1)
+	{
+		best_cost = motion_matching_search_current_cost(db.search_features, query_normalized, curr_index);
+	}
+
+	// Find best successor which is not excluded from the search. 
+	// The cost is accumulated in the same order as the blocked 
+	// kernels so it matches the cost found by the search exactly.
+	int seed_index = -1;
+	float seed_cost = best_cost;
+
+	for (int e = 0; e < warm_start.count; e++)
+	{
+		int i = warm_start.indices[e] + warm_start.elapsed[e];
+
+		int r = db.range_index(warm_start.indices[e]);
+
+		if (i >= db.range_stops(r) - ignore_range_end ||
+			(curr_index != -1 && abs(i - curr_index) < ignore_surrounding))
+		{
+			continue;
+		}
+
+		float cost = search_kernel_scalar::frame_cost(
+			query_normalized.data,
+			db.search_features(i).data,
+			db.nfeatures_padded(),
+			transition_cost,
+			FLT_MAX);
+
+		if (cost < seed_cost || (seed_index != -1 && cost == seed_cost && i < seed_index))
+		{
+			seed_index = i;
+			seed_cost = cost;
+		}
+	}
+
+	warm_start.searches++;
+
+	// Seed the search just above the seed cost so that frames 
+	// with an equal cost and lower index are still found
+	if (seed_index != -1)
+	{
+		warm_start.seeded++;
+		best_index = seed_index;
+		best_cost = nextafterf(seed_cost, FLT_MAX);
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_window<decltype(kernel)>(
+			best_index,
+			best_cost,
+			db.range_starts,
+			db.range_stops,
+			db.search_features_blocked,
+			db.bound_sm_min,
+			db.bound_sm_max,
+			db.bound_lr_min,
+			db.bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			0,
+			db.nframes(),
+			nullptr,
+			stats);
+	});
+
+	if (seed_index != -1 && best_index == seed_index)
+	{
+		best_cost = seed_cost;
+		warm_start.wins++;
+	}
+
+	// Remember the new winner
+	if (best_index != -1 && best_index != curr_index)
+	{
+		int count = warm_start.count < SEARCH_WARM_START_SIZE ? warm_start.count + 1 : SEARCH_WARM_START_SIZE;
+
+		for (int e = count - 1; e > 0; e--)
+		{
+			warm_start.indices[e] = warm_start.indices[e - 1];
+			warm_start.elapsed[e] = warm_start.elapsed[e - 1];
+		}
+
+		warm_start.indices[0] = best_index;
+		warm_start.elapsed[0] = 0;
+		warm_start.count = count;
+	}
+}
+
+//--------------------------------------
+
+void database_search_sliced_begin(
+	search_state& state,
+	const database& db,
+	const slice1d<float> query,
+	const int curr_index,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding)
+{
+	state.query_normalized.resize(db.nfeatures_padded());
+	database_query_normalize(state.query_normalized, db, query);
+
+	state.transition_cost = transition_cost;
+	state.ignore_range_end = ignore_range_end;
+	state.ignore_surrounding = ignore_surrounding;
+	state.curr_index = curr_index;
+	state.best_index = curr_index;
+	state.best_cost = FLT_MAX;
+	state.next = 0;
+	state.active = true;
+
+	// Find cost for current frame
+	if (curr_index != -1)
+	{
+		state.best_cost = motion_matching_search_current_cost(db.search_features, state.query_normalized, curr_index);
+	}
+}
+
+// Continue the search where the last call stopped. As the large
+// boxes are visited in order the result is the same as doing the 
+// whole search at once.
+bool database_search_sliced_step(
+	search_state& state,
+	const database& db,
+	const int max_boxes,
+	const float max_time_us,
+	search_stats* stats)
+{
+	assert(state.active);
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		int boxes = 0;
+
+		while (state.next < db.nframes() && boxes < max_boxes)
+		{
+			// Without a time budget do all the boxes in one window
+			int count = max_time_us > 0.0f ? 1 : max_boxes - boxes;
+			long long stop_frame = state.next + (long long)count * BOUND_LR_SIZE;
+			int stop = stop_frame < db.nframes() ? (int)stop_frame : db.nframes();
+
+			motion_matching_search_window<decltype(kernel)>(
+				state.best_index,
+				state.best_cost,
+				db.range_starts,
+				db.range_stops,
+				db.search_features_blocked,
+				db.bound_sm_min,
+				db.bound_sm_max,
+				db.bound_lr_min,
+				db.bound_lr_max,
+				state.query_normalized,
+				state.transition_cost,
+				state.ignore_range_end,
+				state.ignore_surrounding,
+				state.curr_index,
+				state.next,
+				stop,
+				nullptr,
+				stats);
+
+			state.next = stop;
+			boxes += count;
+
+			if (max_time_us > 0.0f && std::chrono::duration<float, std::micro>(
+				std::chrono::high_resolution_clock::now() - start_time).count() >= max_time_us)
+			{
+				break;
+			}
+		}
+	});
+
+	state.active = state.next < db.nframes();
+
+	return !state.active;
+}
+
+void database_search_sliced_finish(
+	search_state& state,
+	const database& db,
+	search_stats* stats)
+{
+	database_search_sliced_step(state, db, INT_MAX, 0.0f, stats);
+}
+
+//--------------------------------------
+
+// Search only considering frames whose tags match
+void motion_matching_search_tagged(
+	int& RESTRICT best_index,
+	float& RESTRICT best_cost,
+	const slice1d<int> range_starts,
+	const slice1d<int> range_stops,
+	const slice2d<float> features,
+	const slice2d<float> features_blocked,
+	const slice2d<float> bound_sm_min,
+	const slice2d<float> bound_sm_max,
+	const slice2d<float> bound_lr_min,
+	const slice2d<float> bound_lr_max,
+	const slice1d<uint64_t> frame_tags,
+	const slice1d<uint64_t> bound_sm_tags_or,
+	const slice1d<uint64_t> bound_sm_tags_and,
+	const slice1d<uint64_t> bound_lr_tags_or,
+	const slice1d<uint64_t> bound_lr_tags_and,
+	const uint64_t required_tags,
+	const uint64_t excluded_tags,
+	const slice1d<float> query_normalized,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	int curr_index = best_index;
+
+	// Find cost for current frame, if it has the right tags, otherwise 
+	// any matching frame is better. The current frame is then only
+	// used to skip the frames surrounding it.
+	if (best_index != -1 && search_tags_match(frame_tags(curr_index), required_tags, excluded_tags))
 	{
-		query_normalized(i) = (query(i) - db.features_offset(i)) / db.features_scale(i);
+		best_cost = motion_matching_search_current_cost(features, query_normalized, curr_index);
 	}
+	else
+	{
+		best_index = -1;
+		best_cost = FLT_MAX;
+	}
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		motion_matching_search_window<decltype(kernel)>(
+			best_index,
+			best_cost,
+			range_starts,
+			range_stops,
+			features_blocked,
+			bound_sm_min,
+			bound_sm_max,
+			bound_lr_min,
+			bound_lr_max,
+			query_normalized,
+			transition_cost,
+			ignore_range_end,
+			ignore_surrounding,
+			curr_index,
+			0,
+			features.rows,
+			nullptr,
+			stats,
+			frame_tags,
+			bound_sm_tags_or,
+			bound_sm_tags_and,
+			bound_lr_tags_or,
+			bound_lr_tags_and,
+			required_tags,
+			excluded_tags);
+	});
+}
+
+// Search database only considering frames with tags matching
+void database_search_tagged(
+	int& best_index,
+	float& best_cost,
+	const database& db,
+	const slice1d<float> query,
+	const uint64_t required_tags,
+	const uint64_t excluded_tags,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding,
+	search_stats* stats)
+{
+	// Normalize Query
+	array1d<float> query_normalized(db.nfeatures_padded());
+	database_query_normalize(query_normalized, db, query);
 
 	// Search
-	motion_matching_search(
+	motion_matching_search_tagged(
 		best_index,
 		best_cost,
 		db.range_starts,
 		db.range_stops,
-		db.features,
-		db.features_offset,
-		db.features_scale,
+		db.search_features,
+		db.search_features_blocked,
 		db.bound_sm_min,
 		db.bound_sm_max,
 		db.bound_lr_min,
 		db.bound_lr_max,
+		db.frame_tags,
+		db.bound_sm_tags_or,
+		db.bound_sm_tags_and,
+		db.bound_lr_tags_or,
+		db.bound_lr_tags_and,
+		required_tags,
+		excluded_tags,
 		query_normalized,
 		transition_cost,
 		ignore_range_end,
-		ignore_surrounding);
+		ignore_surrounding,
+		stats);
 }
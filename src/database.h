@@ -1,5 +1,7 @@
 #pragma once
 #include "mmpch.h"
+#include "thread_pool.h"
+#include "mapped_file.h"
 
 //--------------------------------------
 
@@ -7,10 +9,62 @@ enum
 {
     BOUND_SM_SIZE = 16,
     BOUND_LR_SIZE = 64,
+    FEATURES_PAD = 8,
+    SEARCH_TASKS_PER_THREAD = 4,
+    KDTREE_STACK_SIZE = 64,
+    SEARCH_RERANK_SIZE = 16,
+    SEARCH_RERANK_MAX = 64,
+    PCA_COMPONENTS = 8,
+    SEARCH_TOPK_MAX = 32,
+    SEARCH_WARM_START_SIZE = 4,
+    SEARCH_SLICE_LR_BOXES = 64,
+    BUILD_CHUNK_SIZE = 1024,
+    FEATURES_CACHE_VERSION = 3,
+    DATABASE_MAPPED_VERSION = 2,
+};
+
+// Acceleration structure used by `database_search`
+enum
+{
+    SEARCH_MODE_BOUNDS = 0,
+    SEARCH_MODE_KDTREE = 1,
+    SEARCH_MODE_QUANTIZED = 2,
+    SEARCH_MODE_PCA = 3,
+};
+
+// Tags which can be given to frames in the database, each
+// being the index of a bit in the per-frame tag mask
+enum
+{
+    TAG_IDLE = 0,
+    TAG_RUN = 1,
+    TAG_WALK = 2,
+    TAG_MIRRORED = 3,
+};
+
+#define TAG_MASK(tag) ((uint64_t)1 << (tag))
+
+// Counters which can be used to compare how well the
+// different acceleration structures prune the search
+struct search_stats
+{
+    int boxes_tested = 0;
+    int boxes_pruned = 0;
+    int frames_tested = 0;
+    int frames_prefiltered = 0;
 };
 
 struct database
 {
+    // Files the arrays may point into when loaded mapped, 
+    // declared first so they are released after the arrays
+    mapped_file mapping;
+    mapped_file features_mapping;
+    
+    // Hash of the contents of the file the database was 
+    // loaded from, used to key data built from it
+    uint64_t hash = 0;
+    
     array2d<vec3> bone_positions;
     array2d<vec3> bone_velocities;
     array2d<quat> bone_rotations;
@@ -20,33 +74,197 @@ struct database
     array1d<int> range_starts;
     array1d<int> range_stops;
     
+    // Index of the range each frame belongs to
+    array1d<int> range_index;
+    
     array2d<float> features;
     array1d<float> features_offset;
     array1d<float> features_scale;
     
+    // Weight each feature dimension was normalized with, so
+    // that the weights can be changed without a full rebuild
+    array1d<float> features_weight;
+    
     array2d<bool> contact_states;
     
+    // Tag mask of each frame, all zero if not given
+    array1d<uint64_t> frame_tags;
+    
+    // Search-side copies of the features. Rows are padded with 
+    // zeros to a multiple of FEATURES_PAD so the search kernels
+    // never need to deal with a tail. The blocked copy stores 
+    // each group of BOUND_SM_SIZE frames (i.e. one small box) 
+    // as one row, with the values of each feature dimension for
+    // all frames in the group stored contiguously.
+    array2d<float> search_features;
+    array2d<float> search_features_blocked;
+    
+    // Search features are stored with the dimensions sorted by
+    // decreasing variance so the kernels can stop early sooner. 
+    // Dimension `j` of the search features is dimension 
+    // `search_features_order(j)` of `features`. Everything else
+    // (e.g. `draw_features` and the LMM networks) uses `features`
+    // which keeps the original order.
+    array1d<int> search_features_order;
+    
+    // Quantized copy of the search features, with each dimension
+    // stored as a signed byte using its own offset and scale so
+    // that the range of that dimension in the database is covered.
+    // Used for a coarse first pass which reads a quarter of the
+    // memory of the full precision features.
+    array2d<signed char> search_features_quantized;
+    array1d<float> search_features_quantized_offset;
+    array1d<float> search_features_quantized_scale;
+    
+    // Bounds use the same padded rows as `search_features`
     array2d<float> bound_sm_min;
     array2d<float> bound_sm_max;
     array2d<float> bound_lr_min;
     array2d<float> bound_lr_max;
     
+    // Tags of all the frames in each box combined with OR 
+    // and AND, used to skip boxes when filtering by tag
+    array1d<uint64_t> bound_sm_tags_or;
+    array1d<uint64_t> bound_sm_tags_and;
+    array1d<uint64_t> bound_lr_tags_or;
+    array1d<uint64_t> bound_lr_tags_and;
+    
+    // KD-tree over the search features, used as an alternative
+    // to the fixed stride bounds. Each node has a bounding box
+    // and either two children or, for leaves, a block of up to
+    // BOUND_SM_SIZE frames stored in the same blocked layout as
+    // `search_features_blocked`. Unused slots of a leaf have a
+    // frame index of -1. The range stop of each frame is kept
+    // so that the end of ranges can still be excluded.
+    array1d<int> kdtree_left;
+    array1d<int> kdtree_right;
+    array1d<int> kdtree_leaf;
+    array2d<float> kdtree_bound_min;
+    array2d<float> kdtree_bound_max;
+    array2d<float> kdtree_features_blocked;
+    array2d<int> kdtree_frames;
+    array2d<int> kdtree_range_stops;
+    
+    // Top PCA_COMPONENTS principal components of the search 
+    // features (one per row) and the projection of every frame
+    // onto them. As the basis is orthonormal the distance between
+    // two projections is a lower bound on the distance between 
+    // the full feature vectors. The distance of every frame from
+    // the mean is kept to bound the rounding error of that.
+    array1d<float> pca_mean;
+    array2d<float> pca_basis;
+    array2d<float> pca_projections;
+    array1d<float> pca_norms;
+    
+    // Covariance of the search features the basis was computed
+    // from, kept so the basis can be updated when the weights
+    // change without another pass over all frames
+    array2d<double> pca_covariance;
+    
     int nframes() const { return bone_positions.rows; }
     int nbones() const { return bone_positions.cols; }
     int nranges() const { return range_starts.size; }
     int nfeatures() const { return features.cols; }
+    int nfeatures_padded() const { return search_features.cols; }
     int ncontacts() const { return contact_states.cols; }
 };
 
 void database_load(database& db, const char* filename);
 
-void database_save_matching_features(const database& db, const char* filename);
+// Write the database, along with the range index built on load,
+// in a layout where every array starts aligned so 
+// it can be mapped into memory by `database_load_mapped`. Stores 
+// the size and modification time of `source_filename`, the file 
+// the database was loaded from. Returns false if the file could
+// not be written.
+bool database_save_mapped(const database& db, const char* filename, const char* source_filename);
+
+// Map a file written by `database_save_mapped` so that the arrays 
+// point straight into the mapping, meaning nothing is read until
+// it is used and processes loading the same file share memory.
+// Returns false if the file does not exist, has a different 
+// version, is truncated, or `source_filename` has changed since 
+// it was written. The file is written under a temporary name 
+// and renamed once complete so a crash while saving cannot 
+// leave a truncated file behind.
+bool database_load_mapped(database& db, const char* filename, const char* source_filename);
+
+// Groups of chunks stored in a database container
+enum
+{
+    DATABASE_CHUNK_BONES = 1 << 0,
+    DATABASE_CHUNK_BONE_VELOCITIES = 1 << 1,
+    DATABASE_CHUNK_RANGES = 1 << 2,
+    DATABASE_CHUNK_CONTACTS = 1 << 3,
+    DATABASE_CHUNK_TAGS = 1 << 4,
+    DATABASE_CHUNK_FEATURES = 1 << 5,
+    DATABASE_CHUNK_SEARCH = 1 << 6,
+    DATABASE_CHUNK_ALL = 0x7F,
+};
+
+// Save the database as a container (see `container.h`). The 
+// features and search structures are included if they are built.
+// Returns false if the file could not be written.
+bool database_save_container(const database& db, const char* filename);
+
+// Map only the given groups of chunks from a container, e.g. a
+// server which only searches can leave out the bone velocities.
+// Groups not asked for are cleared. Note that
+// `nframes` comes from the bone positions so these are almost
+// always needed. Returns false, with everything cleared, if the
+// file cannot be opened, a chunk asked for is missing, or 
+// `verify` is set and a checksum does not match.
+bool database_load_container(
+    database& db,
+    const char* filename,
+    const uint32_t chunks = DATABASE_CHUNK_ALL,
+    const bool verify = false);
+
+// Convert a database in the original format to a container
+bool database_convert_container(const char* database_filename, const char* filename);
+
+// Saves the features, offset and scale followed by an aligned
+// cache section holding the search copies, bounds, KD-tree and PCA
+// along with `hash`, so the whole build can be skipped when
+// nothing it depends on has changed. Readers which only want
+// the features can stop after the first three arrays. Returns
+// false if the file could not be written, in which case any 
+// existing file is left as it was.
+bool database_save_matching_features(const database& db, const char* filename, const uint64_t hash = 0);
+
+// Loads a file written by `database_save_matching_features`.
+// Returns false, leaving the features to be built, if the file
+// does not exist, has no cache section, is truncated, or was 
+// saved with a different hash or cache version. The cache 
+// section is mapped rather than read. Saving writes a new file
+// and renames it over the old one, so the existing mapping is
+// never written to.
+bool database_load_matching_features(database& db, const char* filename, const uint64_t hash);
+
+// Hash of everything the matching features depend on: the
+// contents of the database file, the feature weights, and the 
+// feature schema and layout of the cache section. How each
+// feature is computed is not hashed, so FEATURES_CACHE_VERSION
+// must be bumped whenever the feature extractors change.
+uint64_t database_features_hash(
+    const database& db,
+    const float feature_weight_foot_position,
+    const float feature_weight_foot_velocity,
+    const float feature_weight_hip_velocity,
+    const float feature_weight_trajectory_positions,
+    const float feature_weight_trajectory_directions);
 
 // When we add an offset to a frame in the database there is a chance
 // it will go out of the relevant range so here we can clamp it to 
-// the last frame of that range.
+// the last frame of that range. The frame must be inside a range,
+// which every frame of a database loaded from file is.
 int database_trajectory_index_clamp(database& db, int frame, int offset);
 
+// Build `range_index` from the range starts and stops. This
+// is done on load but needs calling again if the ranges are 
+// changed.
+void database_build_range_index(database& db);
+
 //--------------------------------------
 
 void normalize_feature(
@@ -55,7 +273,8 @@ void normalize_feature(
     slice1d<float> features_scale,
     const int offset,
     const int size,
-    const float weight = 1.0f);
+    const float weight = 1.0f,
+    thread_pool* pool = nullptr);
 
 void denormalize_features(
     slice1d<float> features,
@@ -94,6 +313,18 @@ void forward_kinematics_full(
     const slice1d<quat> local_bone_rotations,
     const slice1d<int> bone_parents);
 
+// Same but including velocity
+void forward_kinematics_velocity_full(
+    slice1d<vec3> global_bone_positions,
+    slice1d<vec3> global_bone_velocities,
+    slice1d<quat> global_bone_rotations,
+    slice1d<vec3> global_bone_angular_velocities,
+    const slice1d<vec3> local_bone_positions,
+    const slice1d<vec3> local_bone_velocities,
+    const slice1d<quat> local_bone_rotations,
+    const slice1d<vec3> local_bone_angular_velocities,
+    const slice1d<int> bone_parents);
+
 // Compute forward kinematics of just some joints using a
 // mask to indicate which joints are already computed
 void forward_kinematics_partial(
@@ -121,45 +352,115 @@ void forward_kinematics_velocity_partial(
 
 //--------------------------------------
 
+// The feature extractors below write the features of frame `i`
+// at `offset` and advance it. The bone features take the global
+// bones of that frame, computed once and shared between them.
+
 // Compute a feature for the position of a bone relative to the simulation/root bone
-void compute_bone_position_feature(database& db, int& offset, int bone, float weight = 1.0f);
+void compute_bone_position_feature(database& db, int& offset, const int i, const int bone, const slice1d<vec3> global_bone_positions);
 
 // Similar but for a bone's velocity
-void compute_bone_velocity_feature(database& db, int& offset, int bone, float weight = 1.0f);
+void compute_bone_velocity_feature(database& db, int& offset, const int i, const int bone, const slice1d<vec3> global_bone_velocities);
 
 // Compute the trajectory at 20, 40, and 60 frames in the future
-void compute_trajectory_position_feature(database& db, int& offset, float weight = 1.0f);
+void compute_trajectory_position_feature(database& db, int& offset, const int i);
 
 // Same for direction
-void compute_trajectory_direction_feature(database& db, int& offset, float weight = 1.0f);
+void compute_trajectory_direction_feature(database& db, int& offset, const int i);
+
+// Build the padded, blocked and quantized copies of the features 
+// used by the search, with the dimensions reordered by variance.
+// These are cached in the features file along with the bounds, 
+// KD-tree and PCA.
+void database_build_search_features(database& db);
 
 // Build the Motion Matching search acceleration structure. Here we
 // just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
-// and BOUND_LR_SIZE frames
-void database_build_bounds(database& db);
+// and BOUND_LR_SIZE frames, along with a summary of the tags in each
+void database_build_bounds(database& db, thread_pool* pool = nullptr);
+
+// Build a KD-tree over the search features by recursively 
+// splitting at the median of the dimension with the largest 
+// spread until each leaf holds at most BOUND_SM_SIZE frames
+void database_build_kdtree(database& db);
+
+// Frame has all of the required tags and none of the excluded
+static inline bool search_tags_match(
+    const uint64_t tags,
+    const uint64_t required_tags,
+    const uint64_t excluded_tags)
+{
+    return (tags & required_tags) == required_tags && (tags & excluded_tags) == 0;
+}
 
-// Build all motion matching features and acceleration structure
+// Some frame in a box could match. Required tags must each be 
+// on at least one frame, and excluded tags must be missing from 
+// at least one frame.
+static inline bool search_tags_match_box(
+    const uint64_t tags_or,
+    const uint64_t tags_and,
+    const uint64_t required_tags,
+    const uint64_t excluded_tags)
+{
+    return (tags_or & required_tags) == required_tags && (tags_and & excluded_tags) == 0;
+}
+
+// Project a padded feature vector onto the PCA basis, 
+// returning its distance from the mean
+float pca_project(
+    slice1d<float> projection,
+    const slice2d<float> pca_basis,
+    const slice1d<float> pca_mean,
+    const slice1d<float> features);
+
+// Compute the PCA basis of the search features and the 
+// projection of every frame onto it
+void database_build_pca(database& db);
+
+// Build all motion matching features and acceleration structure. 
+// When given a pool the work over frames is split between its
+// threads, with reductions always done over the same chunks of 
+// BUILD_CHUNK_SIZE frames so the result does not depend on the 
+// number of threads.
 void database_build_matching_features(
     database& db,
     const float feature_weight_foot_position,
     const float feature_weight_foot_velocity,
     const float feature_weight_hip_velocity,
     const float feature_weight_trajectory_positions,
-    const float feature_weight_trajectory_directions);
+    const float feature_weight_trajectory_directions,
+    thread_pool* pool = nullptr);
+
+// Change the feature weights of a database which already has
+// its matching features built. Each dimension is rescaled in 
+// place along with its normalization scale, the bounds, the 
+// KD-tree boxes and the quantization, so only the PCA needs 
+// recomputing. The order of the search dimensions is kept as 
+// it is only used for the early-out, so searches give the same
+// result as after a full rebuild with the new weights, up to 
+// floating point rounding.
+void database_set_feature_weights(
+    database& db,
+    const float feature_weight_foot_position,
+    const float feature_weight_foot_velocity,
+    const float feature_weight_hip_velocity,
+    const float feature_weight_trajectory_positions,
+    const float feature_weight_trajectory_directions,
+    thread_pool* pool = nullptr);
 
 // Motion Matching search function essentially consists
 // of comparing every feature vector in the database, 
 // against the query feature vector, first checking the 
 // query distance to the axis aligned bounding boxes used 
-// for the acceleration structure.
+// for the acceleration structure. The features, bounds and
+// query are all expected to be padded to FEATURES_PAD.
 void motion_matching_search(
     int& RESTRICT best_index,
     float& RESTRICT best_cost,
     const slice1d<int> range_starts,
     const slice1d<int> range_stops,
     const slice2d<float> features,
-    const slice1d<float> features_offset,
-    const slice1d<float> features_scale,
+    const slice2d<float> features_blocked,
     const slice2d<float> bound_sm_min,
     const slice2d<float> bound_sm_max,
     const slice2d<float> bound_lr_min,
@@ -167,9 +468,93 @@ void motion_matching_search(
     const slice1d<float> query_normalized,
     const float transition_cost,
     const int ignore_range_end,
-    const int ignore_surrounding);
+    const int ignore_surrounding,
+    search_stats* stats = nullptr);
+
+// Same as `motion_matching_search` but using the KD-tree,
+// visiting the nearest child of each node first. Gives 
+// exactly the same result.
+void motion_matching_search_kdtree(
+    int& RESTRICT best_index,
+    float& RESTRICT best_cost,
+    const slice2d<float> features,
+    const slice1d<int> kdtree_left,
+    const slice1d<int> kdtree_right,
+    const slice1d<int> kdtree_leaf,
+    const slice2d<float> kdtree_bound_min,
+    const slice2d<float> kdtree_bound_max,
+    const slice2d<float> kdtree_features_blocked,
+    const slice2d<int> kdtree_frames,
+    const slice2d<int> kdtree_range_stops,
+    const slice1d<float> query_normalized,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    search_stats* stats = nullptr);
+
+// Approximate search which first does a coarse pass using the
+// quantized features, keeping the `nrerank` best candidates. 
+// These are then re-ranked against the full precision features,
+// so the costs output are exact but the best frame may be missed
+// if quantization pushes it out of the candidates. `nrerank` can
+// be at most SEARCH_RERANK_MAX.
+void motion_matching_search_quantized(
+    int& RESTRICT best_index,
+    float& RESTRICT best_cost,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const slice2d<float> features,
+    const slice2d<signed char> features_quantized,
+    const slice1d<float> features_quantized_offset,
+    const slice1d<float> features_quantized_scale,
+    const slice2d<float> bound_sm_min,
+    const slice2d<float> bound_sm_max,
+    const slice2d<float> bound_lr_min,
+    const slice2d<float> bound_lr_max,
+    const slice1d<float> query_normalized,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    const int nrerank = SEARCH_RERANK_SIZE,
+    search_stats* stats = nullptr);
+
+// Same as `motion_matching_search` but before computing the cost
+// of each frame a lower bound is computed from the PCA projections
+// of the frame and query, and the frame is skipped if that is 
+// already worse than the current best. The lower bound is 
+// loosened by a bound on its rounding error, scaled by the 
+// distance of the query and frame from the mean, so this gives
+// the same result. Frames skipped this way are counted in 
+// `stats` as `frames_prefiltered`.
+void motion_matching_search_pca(
+    int& RESTRICT best_index,
+    float& RESTRICT best_cost,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const slice2d<float> features,
+    const slice2d<float> bound_sm_min,
+    const slice2d<float> bound_sm_max,
+    const slice2d<float> bound_lr_min,
+    const slice2d<float> bound_lr_max,
+    const slice2d<float> pca_projections,
+    const slice1d<float> pca_norms,
+    const slice1d<float> query_normalized,
+    const slice1d<float> query_projection,
+    const float query_norm,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    search_stats* stats = nullptr);
+
+// Normalize a query and reorder it to match the search 
+// features, leaving the padding as zero. The output should 
+// have `nfeatures_padded()` elements.
+void database_query_normalize(
+    slice1d<float> query_normalized,
+    const database& db,
+    const slice1d<float> query);
 
-// Search database
+// Search database using the given acceleration structure
 void database_search(
     int& best_index,
     float& best_cost,
@@ -177,4 +562,241 @@ void database_search(
     const slice1d<float> query,
     const float transition_cost = 0.0f,
     const int ignore_range_end = 20,
+    const int ignore_surrounding = 20,
+    const int search_mode = SEARCH_MODE_BOUNDS,
+    search_stats* stats = nullptr);
+
+// Same as `motion_matching_search` but splits the database 
+// into spans of large boxes which are searched in parallel
+// using `pool`. Gives exactly the same result.
+void motion_matching_search_parallel(
+    int& RESTRICT best_index,
+    float& RESTRICT best_cost,
+    thread_pool& pool,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const slice2d<float> features,
+    const slice2d<float> features_blocked,
+    const slice2d<float> bound_sm_min,
+    const slice2d<float> bound_sm_max,
+    const slice2d<float> bound_lr_min,
+    const slice2d<float> bound_lr_max,
+    const slice1d<float> query_normalized,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding);
+
+// Search database in parallel. The number of threads 
+// used is set with `thread_pool_resize`.
+void database_search_parallel(
+    int& best_index,
+    float& best_cost,
+    thread_pool& pool,
+    const database& db,
+    const slice1d<float> query,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20);
+
+// Searches for the best match of many queries at once,
+// walking the boxes a single time and testing every query 
+// still live against each one. Each query has its own 
+// entry in `best_indices` and `best_costs` (given as input 
+// the same as `motion_matching_search`) as well as its own 
+// transition cost and ignore settings. Queries must be 
+// normalized and padded to FEATURES_PAD.
+void motion_matching_search_batch(
+    slice1d<int> best_indices,
+    slice1d<float> best_costs,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const slice2d<float> features,
+    const slice2d<float> features_blocked,
+    const slice2d<float> bound_sm_min,
+    const slice2d<float> bound_sm_max,
+    const slice2d<float> bound_lr_min,
+    const slice2d<float> bound_lr_max,
+    const slice2d<float> queries_normalized,
+    const slice1d<float> transition_costs,
+    const slice1d<int> ignore_range_ends,
+    const slice1d<int> ignore_surroundings);
+
+// Search database for many queries (one per row) at once
+void database_search_batch(
+    slice1d<int> best_indices,
+    slice1d<float> best_costs,
+    const database& db,
+    const slice2d<float> queries,
+    const slice1d<float> transition_costs,
+    const slice1d<int> ignore_range_ends,
+    const slice1d<int> ignore_surroundings);
+
+// Same as `motion_matching_search` but finds the K best 
+// frames, where K is the size of `best_indices`, sorted by 
+// cost (and then by index when costs are equal). The current 
+// frame, if not -1, is included as one of the candidates. If 
+// fewer than K frames are found the remaining entries are -1 
+// with a cost of FLT_MAX. K can be at most SEARCH_TOPK_MAX.
+void motion_matching_search_topk(
+    slice1d<int> best_indices,
+    slice1d<float> best_costs,
+    const int curr_index,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const slice2d<float> features,
+    const slice2d<float> features_blocked,
+    const slice2d<float> bound_sm_min,
+    const slice2d<float> bound_sm_max,
+    const slice2d<float> bound_lr_min,
+    const slice2d<float> bound_lr_max,
+    const slice1d<float> query_normalized,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    search_stats* stats = nullptr);
+
+// Search database for the K best frames
+void database_search_topk(
+    slice1d<int> best_indices,
+    slice1d<float> best_costs,
+    const database& db,
+    const slice1d<float> query,
+    const int curr_index = -1,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20,
+    search_stats* stats = nullptr);
+
+//--------------------------------------
+
+// Per-character cache of the last few frames which won a
+// search along with the number of frames elapsed since. The
+// frames which follow on from these are usually still good 
+// matches so they are used to seed the search with a low 
+// best cost, allowing more boxes to be pruned. Also counts
+// how often this seed ends up being the result.
+struct search_warm_start
+{
+    int indices[SEARCH_WARM_START_SIZE];
+    int elapsed[SEARCH_WARM_START_SIZE];
+    int count = 0;
+    
+    int searches = 0;
+    int seeded = 0;
+    int wins = 0;
+};
+
+// Should be called every frame the character advances
+void search_warm_start_advance(search_warm_start& warm_start, const int frames = 1);
+
+void search_warm_start_reset(search_warm_start& warm_start);
+
+// Same as `database_search` using the bounds, but with the 
+// search seeded from `warm_start`, which is then updated with
+// the result. Gives exactly the same result as `database_search`.
+void database_search_warm_start(
+    int& best_index,
+    float& best_cost,
+    search_warm_start& warm_start,
+    const database& db,
+    const slice1d<float> query,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20,
+    search_stats* stats = nullptr);
+
+//--------------------------------------
+
+// State of a search which is spread over several calls, so 
+// that the cost of the search can be split across frames
+struct search_state
+{
+    array1d<float> query_normalized;
+    float transition_cost = 0.0f;
+    int ignore_range_end = 20;
+    int ignore_surrounding = 20;
+    int curr_index = -1;
+    
+    int best_index = -1;
+    float best_cost = FLT_MAX;
+    
+    // Start of the next large box to be searched
+    int next = 0;
+    bool active = false;
+};
+
+// Start a new search, computing the cost of `curr_index`
+void database_search_sliced_begin(
+    search_state& state,
+    const database& db,
+    const slice1d<float> query,
+    const int curr_index,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
     const int ignore_surrounding = 20);
+
+// Search at most `max_boxes` large boxes, stopping early if 
+// `max_time_us` (when greater than zero) is used up. Returns 
+// true once the search is complete, at which point the result 
+// is in `state.best_index` and `state.best_cost`.
+bool database_search_sliced_step(
+    search_state& state,
+    const database& db,
+    const int max_boxes = SEARCH_SLICE_LR_BOXES,
+    const float max_time_us = 0.0f,
+    search_stats* stats = nullptr);
+
+// Search all remaining boxes
+void database_search_sliced_finish(
+    search_state& state,
+    const database& db,
+    search_stats* stats = nullptr);
+
+//--------------------------------------
+
+// Same as `motion_matching_search` but only considers frames 
+// which have all of `required_tags` and none of `excluded_tags`.
+// Boxes where no frame can match are skipped before computing
+// any distance so filtering makes the search cheaper. If the 
+// current frame does not match it is not used as the initial
+// best cost, so any matching frame will be preferred to it. If
+// no frame matches `best_index` is set to -1 and `best_cost` 
+// to FLT_MAX.
+void motion_matching_search_tagged(
+    int& RESTRICT best_index,
+    float& RESTRICT best_cost,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const slice2d<float> features,
+    const slice2d<float> features_blocked,
+    const slice2d<float> bound_sm_min,
+    const slice2d<float> bound_sm_max,
+    const slice2d<float> bound_lr_min,
+    const slice2d<float> bound_lr_max,
+    const slice1d<uint64_t> frame_tags,
+    const slice1d<uint64_t> bound_sm_tags_or,
+    const slice1d<uint64_t> bound_sm_tags_and,
+    const slice1d<uint64_t> bound_lr_tags_or,
+    const slice1d<uint64_t> bound_lr_tags_and,
+    const uint64_t required_tags,
+    const uint64_t excluded_tags,
+    const slice1d<float> query_normalized,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    search_stats* stats = nullptr);
+
+// Search database only considering frames with matching tags,
+// e.g. `TAG_MASK(TAG_WALK)` as `required_tags` to only walk
+// frames. `best_index` is -1 if no frame matches.
+void database_search_tagged(
+    int& best_index,
+    float& best_cost,
+    const database& db,
+    const slice1d<float> query,
+    const uint64_t required_tags,
+    const uint64_t excluded_tags = 0,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20,
+    search_stats* stats = nullptr);
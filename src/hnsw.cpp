@@ -0,0 +1,510 @@
+#include "mmpch.h"
+#include "hnsw.h"
+#include "mapped_file.h"
+#include "search_kernel.h"
+
+#include <chrono>
+
+//--------------------------------------
+
+static inline slice1d<int> hnsw_neighbours(const hnsw& graph, const int frame, const int layer)
+{
+	return layer == 0 ? graph.neighbours(frame) : graph.upper_neighbours(graph.upper_offsets(frame) + layer - 1);
+}
+
+// Start a new search by bumping the visited epoch
+static inline void hnsw_visited_reset(hnsw_evaluation& evaluation)
+{
+	evaluation.visited_epoch++;
+
+	if (evaluation.visited_epoch == INT_MAX)
+	{
+		evaluation.visited.zero();
+		evaluation.visited_epoch = 1;
+	}
+}
+
+// Greedily walk a single layer towards the query
+template<typename K>
+static int hnsw_search_greedy(
+	float& entry_cost,
+	const hnsw& graph,
+	const slice2d<float> features,
+	const float* RESTRICT query,
+	const int entry,
+	const int layer)
+{
+	int curr = entry;
+	bool changed = true;
+
+	while (changed)
+	{
+		changed = false;
+
+		slice1d<int> neighbours = hnsw_neighbours(graph, curr, layer);
+		for (int k = 0; k < neighbours.size && neighbours(k) != -1; k++)
+		{
+			float cost = K::frame_cost(query, features(neighbours(k)).data, features.cols, 0.0f, entry_cost);
+
+			if (cost < entry_cost)
+			{
+				entry_cost = cost;
+				curr = neighbours(k);
+				changed = true;
+			}
+		}
+	}
+
+	return curr;
+}
+
+// Beam search of width `ef` on a single layer. Frames for which
+// `valid` returns false are still used to move around the graph
+// but are not added to the results. Results are left in
+// `evaluation.results` as a max-heap on cost.
+template<typename K, typename F>
+static void hnsw_search_layer(
+	hnsw_evaluation& evaluation,
+	const hnsw& graph,
+	const slice2d<float> features,
+	const float* RESTRICT query,
+	const int entry,
+	const float entry_cost,
+	const int ef,
+	const int layer,
+	F&& valid)
+{
+	std::vector<std::pair<float, int>>& candidates = evaluation.candidates;
+	std::vector<std::pair<float, int>>& results = evaluation.results;
+	candidates.clear();
+	results.clear();
+
+	hnsw_visited_reset(evaluation);
+	evaluation.visited(entry) = evaluation.visited_epoch;
+
+	candidates.push_back({ entry_cost, entry });
+	if (valid(entry))
+	{
+		results.push_back({ entry_cost, entry });
+	}
+
+	while (!candidates.empty())
+	{
+		std::pop_heap(candidates.begin(), candidates.end(), std::greater<>());
+		std::pair<float, int> candidate = candidates.back();
+		candidates.pop_back();
+
+		// Nearest candidate is further than all results so stop
+		if ((int)results.size() >= ef && candidate.first > results.front().first)
+		{
+			break;
+		}
+
+		slice1d<int> neighbours = hnsw_neighbours(graph, candidate.second, layer);
+		for (int k = 0; k < neighbours.size && neighbours(k) != -1; k++)
+		{
+			int i = neighbours(k);
+
+			if (evaluation.visited(i) == evaluation.visited_epoch)
+			{
+				continue;
+			}
+
+			evaluation.visited(i) = evaluation.visited_epoch;
+
+			float bound_cost = (int)results.size() >= ef ? results.front().first : FLT_MAX;
+			float cost = K::frame_cost(query, features(i).data, features.cols, 0.0f, bound_cost);
+
+			if (cost < bound_cost)
+			{
+				candidates.push_back({ cost, i });
+				std::push_heap(candidates.begin(), candidates.end(), std::greater<>());
+
+				if (valid(i))
+				{
+					results.push_back({ cost, i });
+					std::push_heap(results.begin(), results.end());
+
+					if ((int)results.size() > ef)
+					{
+						std::pop_heap(results.begin(), results.end());
+						results.pop_back();
+					}
+				}
+			}
+		}
+	}
+}
+
+// Pick neighbours from `candidates` (costs relative to the frame
+// being connected) using the heuristic from the HNSW paper which
+// prefers candidates closer to the frame than to any already
+// selected neighbour. Remaining slots are then filled with the
+// closest of the candidates which were skipped.
+template<typename K>
+static void hnsw_select_neighbours(
+	slice1d<int> output,
+	std::vector<std::pair<float, int>>& candidates,
+	std::vector<std::pair<float, int>>& selected,
+	const slice2d<float> features)
+{
+	std::sort(candidates.begin(), candidates.end());
+	selected.clear();
+
+	for (int c = 0; c < (int)candidates.size() && (int)selected.size() < output.size; c++)
+	{
+		bool diverse = true;
+		for (int s = 0; s < (int)selected.size(); s++)
+		{
+			float cost = K::frame_cost(
+				features(candidates[c].second).data,
+				features(selected[s].second).data,
+				features.cols,
+				0.0f,
+				candidates[c].first);
+
+			if (cost < candidates[c].first)
+			{
+				diverse = false;
+				break;
+			}
+		}
+
+		if (diverse)
+		{
+			selected.push_back(candidates[c]);
+		}
+	}
+
+	for (int c = 0; c < (int)candidates.size() && (int)selected.size() < output.size; c++)
+	{
+		if (std::find(selected.begin(), selected.end(), candidates[c]) == selected.end())
+		{
+			selected.push_back(candidates[c]);
+		}
+	}
+
+	output.set(-1);
+	for (int s = 0; s < (int)selected.size(); s++)
+	{
+		output(s) = selected[s].second;
+	}
+}
+
+template<typename K>
+static void hnsw_insert(
+	hnsw& graph,
+	hnsw_evaluation& evaluation,
+	const slice2d<float> features,
+	const int frame,
+	const int ef_construction)
+{
+	int level = graph.levels(frame);
+
+	if (graph.entry_point == -1)
+	{
+		graph.entry_point = frame;
+		graph.max_level = level;
+		return;
+	}
+
+	const float* query = features(frame).data;
+
+	// Walk down the layers above the level of the new frame
+	int entry = graph.entry_point;
+	float entry_cost = K::frame_cost(query, features(entry).data, features.cols, 0.0f, FLT_MAX);
+
+	for (int l = graph.max_level; l > level; l--)
+	{
+		entry = hnsw_search_greedy<K>(entry_cost, graph, features, query, entry, l);
+	}
+
+	// Connect on every layer the frame exists on
+	for (int l = level < graph.max_level ? level : graph.max_level; l >= 0; l--)
+	{
+		hnsw_search_layer<K>(evaluation, graph, features, query, entry, entry_cost, ef_construction, l,
+			[](int) { return true; });
+
+		// Nearest result is the entry point for the next layer
+		for (int r = 0; r < (int)evaluation.results.size(); r++)
+		{
+			if (evaluation.results[r].first < entry_cost)
+			{
+				entry = evaluation.results[r].second;
+				entry_cost = evaluation.results[r].first;
+			}
+		}
+
+		slice1d<int> neighbours = hnsw_neighbours(graph, frame, l);
+		neighbours.set(-1);
+
+		hnsw_select_neighbours<K>(
+			slice1d<int>(graph.m, neighbours.data),
+			evaluation.results,
+			evaluation.selected,
+			features);
+
+		// Add backward connections, shrinking the neighbour's
+		// connections if it already has too many
+		for (int k = 0; k < graph.m && neighbours(k) != -1; k++)
+		{
+			int other = neighbours(k);
+			slice1d<int> other_neighbours = hnsw_neighbours(graph, other, l);
+
+			int slot = 0;
+			while (slot < other_neighbours.size && other_neighbours(slot) != -1)
+			{
+				slot++;
+			}
+
+			if (slot < other_neighbours.size)
+			{
+				other_neighbours(slot) = frame;
+				continue;
+			}
+
+			std::vector<std::pair<float, int>>& candidates = evaluation.candidates;
+			candidates.clear();
+			candidates.push_back({ K::frame_cost(features(other).data, query, features.cols, 0.0f, FLT_MAX), frame });
+			for (int n = 0; n < other_neighbours.size; n++)
+			{
+				candidates.push_back({ K::frame_cost(features(other).data, features(other_neighbours(n)).data, features.cols, 0.0f, FLT_MAX), other_neighbours(n) });
+			}
+
+			hnsw_select_neighbours<K>(other_neighbours, candidates, evaluation.selected, features);
+		}
+	}
+
+	if (level > graph.max_level)
+	{
+		graph.entry_point = frame;
+		graph.max_level = level;
+	}
+}
+
+void hnsw_build(
+	hnsw& graph,
+	const database& db,
+	const int m,
+	const int ef_construction)
+{
+	int nframes = db.nframes();
+
+	graph.m = m;
+	graph.entry_point = -1;
+	graph.max_level = -1;
+
+	// Draw levels from an exponentially decaying distribution
+	// using a fixed seed (xorshift) so builds are repeatable
+	graph.levels.resize(nframes);
+	graph.upper_offsets.resize(nframes);
+
+	unsigned int seed = 0x9E3779B9;
+	float level_mult = 1.0f / logf((float)m);
+	int nupper = 0;
+
+	for (int i = 0; i < nframes; i++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		float u = ((seed >> 8) + 1) / 16777217.0f;
+		graph.levels(i) = (int)(-logf(u) * level_mult);
+		graph.upper_offsets(i) = nupper;
+		nupper += graph.levels(i);
+	}
+
+	graph.neighbours.resize(nframes, 2 * m);
+	graph.neighbours.set(-1);
+	graph.upper_neighbours.resize(nupper, m);
+	graph.upper_neighbours.set(-1);
+
+	// Find the range stop of each frame
+	graph.range_stops.resize(nframes);
+	graph.range_stops.set(-1);
+	for (int r = 0; r < db.nranges(); r++)
+	{
+		for (int i = db.range_starts(r); i < db.range_stops(r); i++)
+		{
+			graph.range_stops(i) = db.range_stops(r);
+		}
+	}
+
+	hnsw_evaluation evaluation;
+	evaluation.resize(graph, db);
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		for (int i = 0; i < nframes; i++)
+		{
+			hnsw_insert<decltype(kernel)>(graph, evaluation, db.search_features, i, ef_construction);
+		}
+	});
+}
+
+bool hnsw_save(const hnsw& graph, const char* filename, const uint64_t hash)
+{
+	FILE* f = mapped_file_create(filename);
+	if (f == NULL) { return false; }
+
+	fwrite(&hash, sizeof(uint64_t), 1, f);
+	fwrite(&graph.m, sizeof(int), 1, f);
+	fwrite(&graph.entry_point, sizeof(int), 1, f);
+	fwrite(&graph.max_level, sizeof(int), 1, f);
+
+	array1d_write(graph.levels, f);
+	array2d_write(graph.neighbours, f);
+	array1d_write(graph.upper_offsets, f);
+	array2d_write(graph.upper_neighbours, f);
+	array1d_write(graph.range_stops, f);
+
+	return mapped_file_commit(f, filename);
+}
+
+bool hnsw_load(hnsw& graph, const char* filename, const uint64_t hash)
+{
+	mapped_file file;
+	if (!mapped_file_open(file, filename)) { return false; }
+
+	size_t offset = 0;
+	uint64_t file_hash = 0;
+	if (!mapped_file_read(&file_hash, sizeof(uint64_t), file, offset) || file_hash != hash) { return false; }
+
+	return
+		mapped_file_read(&graph.m, sizeof(int), file, offset) &&
+		mapped_file_read(&graph.entry_point, sizeof(int), file, offset) &&
+		mapped_file_read(&graph.max_level, sizeof(int), file, offset) &&
+		mapped_file_copy_array1d(graph.levels, file, offset) &&
+		mapped_file_copy_array2d(graph.neighbours, file, offset) &&
+		mapped_file_copy_array1d(graph.upper_offsets, file, offset) &&
+		mapped_file_copy_array2d(graph.upper_neighbours, file, offset) &&
+		mapped_file_copy_array1d(graph.range_stops, file, offset);
+}
+
+//--------------------------------------
+
+void hnsw_search(
+	int& best_index,
+	float& best_cost,
+	hnsw_evaluation& evaluation,
+	const hnsw& graph,
+	const database& db,
+	const slice1d<float> query,
+	const int ef,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding)
+{
+	database_query_normalize(evaluation.query_normalized, db, query);
+
+	int curr_index = best_index;
+
+	search_kernel_dispatch([&](auto kernel)
+	{
+		using K = decltype(kernel);
+
+		const float* query_normalized = evaluation.query_normalized.data;
+
+		// Find cost for current frame
+		if (curr_index != -1)
+		{
+			best_cost = K::frame_cost(query_normalized, db.search_features(curr_index).data, db.nfeatures_padded(), 0.0f, FLT_MAX);
+		}
+
+		if (graph.entry_point == -1)
+		{
+			return;
+		}
+
+		// Greedy search down to the bottom layer
+		int entry = graph.entry_point;
+		float entry_cost = K::frame_cost(query_normalized, db.search_features(entry).data, db.nfeatures_padded(), 0.0f, FLT_MAX);
+
+		for (int l = graph.max_level; l > 0; l--)
+		{
+			entry = hnsw_search_greedy<K>(entry_cost, graph, db.search_features, query_normalized, entry, l);
+		}
+
+		// Beam search excluding the end of ranges and surrounding frames
+		hnsw_search_layer<K>(evaluation, graph, db.search_features, query_normalized, entry, entry_cost, ef, 0,
+			[&](int i)
+		{
+			return i < graph.range_stops(i) - ignore_range_end &&
+				!(curr_index != -1 && abs(i - curr_index) < ignore_surrounding);
+		});
+
+		// Pick best result, taking lowest index on ties like the exact search
+		bool found = false;
+		for (int r = 0; r < (int)evaluation.results.size(); r++)
+		{
+			float cost = evaluation.results[r].first + transition_cost;
+			int i = evaluation.results[r].second;
+
+			if (cost < best_cost || (found && cost == best_cost && i < best_index))
+			{
+				best_index = i;
+				best_cost = cost;
+				found = true;
+			}
+		}
+	});
+}
+
+void hnsw_recall(
+	float& recall,
+	float& exact_time,
+	float& approx_time,
+	hnsw_evaluation& evaluation,
+	const hnsw& graph,
+	const database& db,
+	const int ef,
+	const int nqueries,
+	const float transition_cost,
+	const int ignore_range_end,
+	const int ignore_surrounding)
+{
+	recall = 0.0f;
+	exact_time = 0.0f;
+	approx_time = 0.0f;
+
+	array1d<float> query(db.nfeatures());
+
+	for (int q = 0; q < nqueries; q++)
+	{
+		// Make a query by mixing the features of two frames
+		// far apart in the database so that it does not
+		// exactly match any existing frame
+		int frame0 = (int)(((long long)q * db.nframes()) / nqueries);
+		int frame1 = (frame0 + db.nframes() / 2) % db.nframes();
+
+		for (int j = 0; j < db.nfeatures(); j++)
+		{
+			float value = 0.5f * (db.features(frame0, j) + db.features(frame1, j));
+			query(j) = value * db.features_scale(j) + db.features_offset(j);
+		}
+
+		int exact_index = -1;
+		float exact_cost = FLT_MAX;
+		int approx_index = -1;
+		float approx_cost = FLT_MAX;
+
+		auto t0 = std::chrono::high_resolution_clock::now();
+
+		database_search(exact_index, exact_cost, db, query, transition_cost, ignore_range_end, ignore_surrounding);
+
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		hnsw_search(approx_index, approx_cost, evaluation, graph, db, query, ef, transition_cost, ignore_range_end, ignore_surrounding);
+
+		auto t2 = std::chrono::high_resolution_clock::now();
+
+		recall += approx_index == exact_index ? 1.0f : 0.0f;
+		exact_time += std::chrono::duration<float, std::micro>(t1 - t0).count();
+		approx_time += std::chrono::duration<float, std::micro>(t2 - t1).count();
+	}
+
+	recall /= nqueries;
+	exact_time /= nqueries;
+	approx_time /= nqueries;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "mmpch.h"
+#include "database.h"
+
+#include <vector>
+#include <utility>
+
+//--------------------------------------
+
+enum
+{
+    HNSW_M = 16,
+    HNSW_EF_CONSTRUCTION = 100,
+    HNSW_EF_SEARCH = 32,
+};
+
+// Hierarchical Navigable Small World graph built over the
+// search features, used for approximate Motion Matching
+// search in databases too large for the exact search. Each
+// frame is a node which exists on all layers up to its level.
+// On the bottom layer frames have up to 2*M neighbours and
+// on the upper layers up to M. Unused slots are -1.
+struct hnsw
+{
+    int m = HNSW_M;
+    int entry_point = -1;
+    int max_level = -1;
+
+    array1d<int> levels;
+    array2d<int> neighbours;
+
+    // Neighbours of frame `i` on layer `l > 0` are stored
+    // in row `upper_offsets(i) + l - 1`
+    array1d<int> upper_offsets;
+    array2d<int> upper_neighbours;
+
+    // Range stop of each frame so that the end of
+    // ranges can be excluded from the search
+    array1d<int> range_stops;
+
+    int nframes() const { return levels.size; }
+};
+
+// Storage used during the search, pre-allocated in the
+// same way as `nnet_evaluation`
+struct hnsw_evaluation
+{
+    array1d<int> visited;
+    int visited_epoch = 0;
+
+    std::vector<std::pair<float, int>> candidates;
+    std::vector<std::pair<float, int>> results;
+    std::vector<std::pair<float, int>> selected;
+
+    array1d<float> query_normalized;
+
+    void resize(const hnsw& graph, const database& db)
+    {
+        visited.resize(graph.nframes());
+        visited.zero();
+        visited_epoch = 0;
+        query_normalized.resize(db.nfeatures_padded());
+    }
+};
+
+// Build the graph from the search features of the database.
+// Levels are drawn from a fixed seed so the same database
+// always produces the same graph.
+void hnsw_build(
+    hnsw& graph,
+    const database& db,
+    const int m = HNSW_M,
+    const int ef_construction = HNSW_EF_CONSTRUCTION);
+
+// Save the graph along with a hash of what it was built from, 
+// e.g. `database_features_hash`, so it can be reused when that 
+// has not changed. Returns false if the file could not be written.
+bool hnsw_save(const hnsw& graph, const char* filename, const uint64_t hash = 0);
+
+// Returns false, leaving the graph to be built, if the file does
+// not exist, is truncated, or was saved with a different hash
+bool hnsw_load(hnsw& graph, const char* filename, const uint64_t hash);
+
+// Approximate version of `database_search`. Uses a greedy
+// search on the upper layers followed by a beam search of
+// width `ef` on the bottom layer. Larger `ef` gives better
+// recall at the cost of more distance evaluations. The
+// same exclusions as the exact search are applied.
+void hnsw_search(
+    int& best_index,
+    float& best_cost,
+    hnsw_evaluation& evaluation,
+    const hnsw& graph,
+    const database& db,
+    const slice1d<float> query,
+    const int ef = HNSW_EF_SEARCH,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20);
+
+// Estimates the recall of `hnsw_search` for a given `ef` by
+// using `nqueries` frames spread across the database as
+// queries and checking how often the exact search finds the
+// same frame. Also outputs the average time taken by each
+// search in microseconds.
+void hnsw_recall(
+    float& recall,
+    float& exact_time,
+    float& approx_time,
+    hnsw_evaluation& evaluation,
+    const hnsw& graph,
+    const database& db,
+    const int ef = HNSW_EF_SEARCH,
+    const int nqueries = 100,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20);
@@ -1,31 +1,13 @@
 #include "mmpch.h"
 #include "lmm.h"
 
-// This function uses the decompressor network
-// to generate the pose of the character. It 
-// requires as input the feature values and latent 
-// values as well as a current root position and 
-// rotation.
-void decompressor_evaluate(
-	slice1d<vec3> bone_positions,
-	slice1d<vec3> bone_velocities,
-	slice1d<quat> bone_rotations,
-	slice1d<vec3> bone_angular_velocities,
-	slice1d<bool> bone_contacts,
-	nnet_evaluation& evaluation,
+// Copy feature values and latent variables to 
+// the input layer of the network
+static void lmm_input(
+	slice1d<float> input_layer,
 	const slice1d<float> features,
-	const slice1d<float> latent,
-	const vec3 root_position,
-	const quat root_rotation,
-	const nnet& nn,
-	const float dt)
+	const slice1d<float> latent)
 {
-	slice1d<float> input_layer = evaluation.layers.front();
-	slice1d<float> output_layer = evaluation.layers.back();
-
-	// First copy feature values and latent variables to 
-	// the input layer of the network
-
 	for (int i = 0; i < features.size; i++)
 	{
 		input_layer(i) = features(i);
@@ -35,10 +17,21 @@ void decompressor_evaluate(
 	{
 		input_layer(features.size + i) = latent(i);
 	}
+}
 
-	// Evaluate network
-	nnet_evaluate(evaluation, nn);
-
+// Extract the pose from the output of the decompressor
+static void decompressor_output(
+	slice1d<vec3> bone_positions,
+	slice1d<vec3> bone_velocities,
+	slice1d<quat> bone_rotations,
+	slice1d<vec3> bone_angular_velocities,
+	slice1d<bool> bone_contacts,
+	const slice1d<float> output_layer,
+	const vec3 root_position,
+	const quat root_rotation,
+	const nnet& nn,
+	const float dt)
+{
 	// Extract bone positions
 	int offset = 0;
 	for (int i = 0; i < bone_positions.size - 1; i++)
@@ -117,29 +110,111 @@ void decompressor_evaluate(
 	assert(offset == nn.output_mean.size);
 }
 
-// This function updates the feature and latent values
-// using the stepper network and a given dt.
-void stepper_evaluate(
-	slice1d<float> features,
-	slice1d<float> latent,
+// This function uses the decompressor network
+// to generate the pose of the character. It 
+// requires as input the feature values and latent 
+// values as well as a current root position and 
+// rotation.
+void decompressor_evaluate(
+	slice1d<vec3> bone_positions,
+	slice1d<vec3> bone_velocities,
+	slice1d<quat> bone_rotations,
+	slice1d<vec3> bone_angular_velocities,
+	slice1d<bool> bone_contacts,
 	nnet_evaluation& evaluation,
+	const slice1d<float> features,
+	const slice1d<float> latent,
+	const vec3 root_position,
+	const quat root_rotation,
 	const nnet& nn,
 	const float dt)
 {
-	slice1d<float> input_layer = evaluation.layers.front();
-	slice1d<float> output_layer = evaluation.layers.back();
+	lmm_input(evaluation.layers.front(), features, latent);
 
-	// Copy features and latents to input
+	nnet_evaluate(evaluation, nn);
+
+	decompressor_output(
+		bone_positions,
+		bone_velocities,
+		bone_rotations,
+		bone_angular_velocities,
+		bone_contacts,
+		evaluation.layers.back(),
+		root_position,
+		root_rotation,
+		nn,
+		dt);
+}
+
+void decompressor_evaluate_batch(
+	slice2d<vec3> bone_positions,
+	slice2d<vec3> bone_velocities,
+	slice2d<quat> bone_rotations,
+	slice2d<vec3> bone_angular_velocities,
+	slice2d<bool> bone_contacts,
+	nnet_evaluation_batch& evaluation,
+	const slice2d<float> features,
+	const slice2d<float> latent,
+	const slice1d<vec3> root_positions,
+	const slice1d<quat> root_rotations,
+	const nnet& nn,
+	const float dt)
+{
+	assert(evaluation.nbatch() == features.rows);
 
+	for (int b = 0; b < features.rows; b++)
+	{
+		lmm_input(evaluation.layers.front()(b), features(b), latent(b));
+	}
+
+	nnet_evaluate_batch(evaluation, nn);
+
+	for (int b = 0; b < features.rows; b++)
+	{
+		decompressor_output(
+			bone_positions(b),
+			bone_velocities(b),
+			bone_rotations(b),
+			bone_angular_velocities(b),
+			bone_contacts.data != nullptr ? bone_contacts(b) : slice1d<bool>(0, nullptr),
+			evaluation.layers.back()(b),
+			root_positions(b),
+			root_rotations(b),
+			nn,
+			dt);
+	}
+}
+
+// Integrate the feature and latent velocities output by the stepper
+static void stepper_output(
+	slice1d<float> features,
+	slice1d<float> latent,
+	const slice1d<float> output_layer,
+	const float dt)
+{
 	for (int i = 0; i < features.size; i++)
 	{
-		input_layer(i) = features(i);
+		features(i) += dt * output_layer(i);
 	}
 
 	for (int i = 0; i < latent.size; i++)
 	{
-		input_layer(features.size + i) = latent(i);
+		latent(i) += dt * output_layer(features.size + i);
 	}
+}
+
+// This function updates the feature and latent values
+// using the stepper network and a given dt.
+void stepper_evaluate(
+	slice1d<float> features,
+	slice1d<float> latent,
+	nnet_evaluation& evaluation,
+	const nnet& nn,
+	const float dt)
+{
+	// Copy features and latents to input
+
+	lmm_input(evaluation.layers.front(), features, latent);
 
 	// Evaluate network
 
@@ -147,51 +222,56 @@ void stepper_evaluate(
 
 	// Update features and latents using result
 
-	for (int i = 0; i < features.size; i++)
+	stepper_output(features, latent, evaluation.layers.back(), dt);
+}
+
+void stepper_evaluate_batch(
+	slice2d<float> features,
+	slice2d<float> latent,
+	nnet_evaluation_batch& evaluation,
+	const nnet& nn,
+	const float dt)
+{
+	assert(evaluation.nbatch() == features.rows);
+
+	for (int b = 0; b < features.rows; b++)
 	{
-		features(i) += dt * output_layer(i);
+		lmm_input(evaluation.layers.front()(b), features(b), latent(b));
 	}
 
-	for (int i = 0; i < latent.size; i++)
+	nnet_evaluate_batch(evaluation, nn);
+
+	for (int b = 0; b < features.rows; b++)
 	{
-		latent(i) += dt * output_layer(features.size + i);
+		stepper_output(features(b), latent(b), evaluation.layers.back()(b), dt);
 	}
 }
 
-// This function projects a set of feature values onto
-// the nearest in the trained database, also outputting the 
-// associated latent values. It also produces the matching 
-// cost using the distance of the projection, and detects 
-// transitions for a given transition cost by measuring the 
-// distance between the projected result and the current
-// feature values
-void projector_evaluate(
-	bool& transition,
-	float& best_cost,
-	slice1d<float> proj_features,
-	slice1d<float> proj_latent,
-	nnet_evaluation& evaluation,
+// Copy query features to the input of the projector
+static void projector_input(
+	slice1d<float> input_layer,
 	const slice1d<float> query,
 	const slice1d<float> features_offset,
-	const slice1d<float> features_scale,
-	const slice1d<float> curr_features,
-	const nnet& nn,
-	const float transition_cost)
+	const slice1d<float> features_scale)
 {
-	slice1d<float> input_layer = evaluation.layers.front();
-	slice1d<float> output_layer = evaluation.layers.back();
-
-	// Copy query features to input
-
 	for (int i = 0; i < query.size; i++)
 	{
 		input_layer(i) = (query(i) - features_offset(i)) / features_scale(i);
 	}
+}
 
-	// Evaluate network
-
-	nnet_evaluate(evaluation, nn);
-
+// Extract the projected features and latents from the output 
+// of the projector and decide if this is a transition
+static void projector_output(
+	bool& transition,
+	float& best_cost,
+	slice1d<float> proj_features,
+	slice1d<float> proj_latent,
+	const slice1d<float> output_layer,
+	const slice1d<float> query,
+	const slice1d<float> curr_features,
+	const float transition_cost)
+{
 	// Copy projected features and latents from output
 
 	for (int i = 0; i < proj_features.size; i++)
@@ -250,3 +330,108 @@ void projector_evaluate(
 		best_cost = sqrtf(best_cost);
 	}
 }
+
+// This function projects a set of feature values onto
+// the nearest in the trained database, also outputting the 
+// associated latent values. It also produces the matching 
+// cost using the distance of the projection, and detects 
+// transitions for a given transition cost by measuring the 
+// distance between the projected result and the current
+// feature values
+void projector_evaluate(
+	bool& transition,
+	float& best_cost,
+	slice1d<float> proj_features,
+	slice1d<float> proj_latent,
+	nnet_evaluation& evaluation,
+	const slice1d<float> query,
+	const slice1d<float> features_offset,
+	const slice1d<float> features_scale,
+	const slice1d<float> curr_features,
+	const nnet& nn,
+	const float transition_cost)
+{
+	// Copy query features to input
+
+	projector_input(evaluation.layers.front(), query, features_offset, features_scale);
+
+	// Evaluate network
+
+	nnet_evaluate(evaluation, nn);
+
+	// Copy projected features and latents from output
+
+	projector_output(
+		transition,
+		best_cost,
+		proj_features,
+		proj_latent,
+		evaluation.layers.back(),
+		query,
+		curr_features,
+		transition_cost);
+}
+
+void projector_evaluate_batch(
+	slice1d<bool> transition,
+	slice1d<float> best_cost,
+	slice2d<float> proj_features,
+	slice2d<float> proj_latent,
+	nnet_evaluation_batch& evaluation,
+	const slice2d<float> query,
+	const slice1d<float> features_offset,
+	const slice1d<float> features_scale,
+	const slice2d<float> curr_features,
+	const nnet& nn,
+	const float transition_cost)
+{
+	assert(evaluation.nbatch() == query.rows);
+
+	for (int b = 0; b < query.rows; b++)
+	{
+		projector_input(evaluation.layers.front()(b), query(b), features_offset, features_scale);
+	}
+
+	nnet_evaluate_batch(evaluation, nn);
+
+	for (int b = 0; b < query.rows; b++)
+	{
+		projector_output(
+			transition(b),
+			best_cost(b),
+			proj_features(b),
+			proj_latent(b),
+			evaluation.layers.back()(b),
+			query(b),
+			curr_features(b),
+			transition_cost);
+	}
+}
+
+void projector_replay(
+	slice2d<float> projector_inputs,
+	slice2d<float> lmm_inputs,
+	nnet_evaluation& evaluation,
+	const slice2d<float> features,
+	const slice1d<float> features_offset,
+	const slice1d<float> features_scale,
+	const nnet& nn)
+{
+	assert(projector_inputs.rows == lmm_inputs.rows && projector_inputs.rows <= features.rows);
+	assert(lmm_inputs.cols == evaluation.layers.back().size);
+
+	for (int r = 0; r < projector_inputs.rows; r++)
+	{
+		int frame = (int)(((int64_t)r * features.rows) / projector_inputs.rows);
+
+		projector_input(projector_inputs(r), features(frame), features_offset, features_scale);
+
+		evaluation.layers.front() = projector_inputs(r);
+		nnet_evaluate(evaluation, nn);
+
+		for (int i = 0; i < lmm_inputs.cols; i++)
+		{
+			lmm_inputs(r, i) = evaluation.layers.back()(i);
+		}
+	}
+}
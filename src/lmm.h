@@ -52,4 +52,61 @@ void projector_evaluate(
     const slice1d<float> features_scale,
     const slice1d<float> curr_features,
     const nnet& nn,
-    const float transition_cost = 0.0f);
\ No newline at end of file
+    const float transition_cost = 0.0f);
+
+//--------------------------------------
+
+// Batched versions of the above for evaluating many characters
+// at once, with the inputs and outputs of each in a row. These
+// give the same result as evaluating each character on its own
+// but go through the network weights once per block of rows.
+
+void decompressor_evaluate_batch(
+    slice2d<vec3> bone_positions,
+    slice2d<vec3> bone_velocities,
+    slice2d<quat> bone_rotations,
+    slice2d<vec3> bone_angular_velocities,
+    slice2d<bool> bone_contacts,
+    nnet_evaluation_batch& evaluation,
+    const slice2d<float> features,
+    const slice2d<float> latent,
+    const slice1d<vec3> root_positions,
+    const slice1d<quat> root_rotations,
+    const nnet& nn,
+    const float dt = 1.0f / 60.0f);
+
+void stepper_evaluate_batch(
+    slice2d<float> features,
+    slice2d<float> latent,
+    nnet_evaluation_batch& evaluation,
+    const nnet& nn,
+    const float dt = 1.0f / 60.0f);
+
+void projector_evaluate_batch(
+    slice1d<bool> transition,
+    slice1d<float> best_cost,
+    slice2d<float> proj_features,
+    slice2d<float> proj_latent,
+    nnet_evaluation_batch& evaluation,
+    const slice2d<float> query,
+    const slice1d<float> features_offset,
+    const slice1d<float> features_scale,
+    const slice2d<float> curr_features,
+    const nnet& nn,
+    const float transition_cost = 0.0f);
+
+//--------------------------------------
+
+// Replay frames of the database, evenly spaced through `features`,
+// through the projector. Gives the input of the projector for each
+// frame and the features and latents it outputs, which are in turn
+// the input of the decompressor and stepper. Used to check changes
+// to the networks, such as quantization, on realistic inputs.
+void projector_replay(
+    slice2d<float> projector_inputs,
+    slice2d<float> lmm_inputs,
+    nnet_evaluation& evaluation,
+    const slice2d<float> features,
+    const slice1d<float> features_offset,
+    const slice1d<float> features_scale,
+    const nnet& nn);
\ No newline at end of file
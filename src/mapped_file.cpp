@@ -0,0 +1,155 @@
+#include "mmpch.h"
+#include "mapped_file.h"
+
+#ifdef _WIN32
+// Keep out the parts of the Windows headers which clash with raylib
+#define WIN32_LEAN_AND_MEAN
+#define NOGDI
+#define NOUSER
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+mapped_file::~mapped_file()
+{
+	mapped_file_close(*this);
+}
+
+bool mapped_file_open(mapped_file& file, const char* filename)
+{
+	mapped_file_close(file);
+
+#ifdef _WIN32
+	// Sharing delete and write lets `mapped_file_commit` replace 
+	// the file while it is still mapped, as rename does elsewhere
+	DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+	HANDLE file_handle = CreateFileA(filename, GENERIC_READ, share, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE) { return false; }
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_handle, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file_handle);
+		return false;
+	}
+
+	HANDLE mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapping_handle == NULL)
+	{
+		CloseHandle(file_handle);
+		return false;
+	}
+
+	void* data = MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0);
+	if (data == NULL)
+	{
+		CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+		return false;
+	}
+
+	file.data = (char*)data;
+	file.size = (size_t)size.QuadPart;
+	file.file_handle = file_handle;
+	file.mapping_handle = mapping_handle;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) { return false; }
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+
+	file.data = (char*)data;
+	file.size = (size_t)st.st_size;
+	file.fd = fd;
+#endif
+
+	return true;
+}
+
+void mapped_file_close(mapped_file& file)
+{
+	if (file.data == NULL) { return; }
+
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle((HANDLE)file.mapping_handle);
+	CloseHandle((HANDLE)file.file_handle);
+	file.file_handle = NULL;
+	file.mapping_handle = NULL;
+#else
+	munmap(file.data, file.size);
+	close(file.fd);
+	file.fd = -1;
+#endif
+
+	file.data = NULL;
+	file.size = 0;
+}
+
+void mapped_file_swap(mapped_file& lhs, mapped_file& rhs)
+{
+	std::swap(lhs.data, rhs.data);
+	std::swap(lhs.size, rhs.size);
+#ifdef _WIN32
+	std::swap(lhs.file_handle, rhs.file_handle);
+	std::swap(lhs.mapping_handle, rhs.mapping_handle);
+#else
+	std::swap(lhs.fd, rhs.fd);
+#endif
+}
+
+// Name the file is written under until it is complete
+static void mapped_file_temp_name(char* temp, const size_t temp_size, const char* filename)
+{
+	snprintf(temp, temp_size, "%s.tmp", filename);
+}
+
+FILE* mapped_file_create(const char* filename)
+{
+	char temp[512];
+	mapped_file_temp_name(temp, sizeof(temp), filename);
+	return fopen(temp, "wb");
+}
+
+bool mapped_file_commit(FILE* f, const char* filename)
+{
+	char temp[512];
+	mapped_file_temp_name(temp, sizeof(temp), filename);
+
+	bool written = ferror(f) == 0;
+	written = fclose(f) == 0 && written;
+
+	if (!written)
+	{
+		remove(temp);
+		return false;
+	}
+
+#ifdef _WIN32
+	if (!MoveFileExA(temp, filename, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (rename(temp, filename) != 0)
+#endif
+	{
+		remove(temp);
+		return false;
+	}
+
+	return true;
+}
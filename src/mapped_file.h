@@ -0,0 +1,149 @@
+#pragma once
+
+#include "mmpch.h"
+
+//--------------------------------------
+
+// A file mapped into memory. Pages are mapped copy-on-write
+// so processes mapping the same file share the physical 
+// memory for as long as they only read from it, while writes
+// (e.g. when features are rebuilt in place) go to private 
+// copies and are never written back to the file.
+struct mapped_file
+{
+    char* data = NULL;
+    size_t size = 0;
+    
+#ifdef _WIN32
+    void* file_handle = NULL;
+    void* mapping_handle = NULL;
+#else
+    int fd = -1;
+#endif
+
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file();
+};
+
+// Returns false if the file does not exist or is empty
+bool mapped_file_open(mapped_file& file, const char* filename);
+
+// Any arrays mapped to the file must not be used after this
+void mapped_file_close(mapped_file& file);
+
+// Exchange two mapped files, used to replace a mapping once
+// all arrays have been moved over to the new one
+void mapped_file_swap(mapped_file& lhs, mapped_file& rhs);
+
+// Files are written under a temporary name and only renamed
+// to `filename` once complete, so that a crash or full disk 
+// while writing never leaves a truncated file to be mapped.
+// Returns NULL if the file cannot be created.
+FILE* mapped_file_create(const char* filename);
+
+// Close a file from `mapped_file_create` and rename it. If
+// anything failed to be written the file is removed instead
+// and false is returned.
+bool mapped_file_commit(FILE* f, const char* filename);
+
+//--------------------------------------
+
+// Mapped files store arrays in the same way as `array1d_write` 
+// and `array2d_write` but with zero padding after the sizes so 
+// that the data starts at a multiple of ARRAY_ALIGNMENT from the
+// start of the file. As mappings start on a page boundary the 
+// arrays can then point directly into the mapping.
+
+static inline void mapped_file_write_padding(FILE* f)
+{
+    const char zeros[ARRAY_ALIGNMENT] = { 0 };
+    long offset = ftell(f);
+    long padding = (ARRAY_ALIGNMENT - (offset % ARRAY_ALIGNMENT)) % ARRAY_ALIGNMENT;
+    fwrite(zeros, 1, padding, f);
+}
+
+template<typename T>
+void mapped_file_write_array1d(const array1d<T>& arr, FILE* f)
+{
+    fwrite(&arr.size, sizeof(int), 1, f);
+    mapped_file_write_padding(f);
+    size_t num = fwrite(arr.data, sizeof(T), arr.size, f);
+    assert((int)num == arr.size);
+}
+
+template<typename T>
+void mapped_file_write_array2d(const array2d<T>& arr, FILE* f)
+{
+    fwrite(&arr.rows, sizeof(int), 1, f);
+    fwrite(&arr.cols, sizeof(int), 1, f);
+    mapped_file_write_padding(f);
+    size_t num = fwrite(arr.data, sizeof(T), arr.rows * arr.cols, f);
+    assert((int)num == arr.rows * arr.cols);
+}
+
+// The readers below return false if the file is too short
+
+// Copy some bytes at `offset` and advance it
+static inline bool mapped_file_read(void* data, size_t size, const mapped_file& file, size_t& offset)
+{
+    if (offset > file.size || size > file.size - offset) { return false; }
+    memcpy(data, file.data + offset, size);
+    offset += size;
+    return true;
+}
+
+static inline void mapped_file_read_padding(size_t& offset)
+{
+    offset = ((offset + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT) * ARRAY_ALIGNMENT;
+}
+
+template<typename T>
+bool mapped_file_read_array1d(array1d<T>& arr, const mapped_file& file, size_t& offset)
+{
+    int size;
+    if (!mapped_file_read(&size, sizeof(int), file, offset)) { return false; }
+    mapped_file_read_padding(offset);
+    if (size < 0 || offset > file.size || (size_t)size > (file.size - offset) / sizeof(T)) { return false; }
+    arr.map((T*)(file.data + offset), size);
+    offset += (size_t)size * sizeof(T);
+    return true;
+}
+
+template<typename T>
+bool mapped_file_read_array2d(array2d<T>& arr, const mapped_file& file, size_t& offset)
+{
+    int rows, cols;
+    if (!mapped_file_read(&rows, sizeof(int), file, offset) ||
+        !mapped_file_read(&cols, sizeof(int), file, offset)) { return false; }
+    mapped_file_read_padding(offset);
+    if (rows < 0 || cols < 0 || offset > file.size || (size_t)rows * cols > (file.size - offset) / sizeof(T)) { return false; }
+    arr.map((T*)(file.data + offset), rows, cols);
+    offset += (size_t)rows * cols * sizeof(T);
+    return true;
+}
+
+// Copy arrays written by `array1d_write` and `array2d_write`,
+// which are not aligned so cannot be mapped
+
+template<typename T>
+bool mapped_file_copy_array1d(array1d<T>& arr, const mapped_file& file, size_t& offset)
+{
+    int size;
+    if (!mapped_file_read(&size, sizeof(int), file, offset)) { return false; }
+    if (size < 0 || offset > file.size || (size_t)size > (file.size - offset) / sizeof(T)) { return false; }
+    arr.resize(size);
+    return mapped_file_read(arr.data, (size_t)size * sizeof(T), file, offset);
+}
+
+template<typename T>
+bool mapped_file_copy_array2d(array2d<T>& arr, const mapped_file& file, size_t& offset)
+{
+    int rows, cols;
+    if (!mapped_file_read(&rows, sizeof(int), file, offset) ||
+        !mapped_file_read(&cols, sizeof(int), file, offset)) { return false; }
+    if (rows < 0 || cols < 0 || offset > file.size || (size_t)rows * cols > (file.size - offset) / sizeof(T)) { return false; }
+    arr.resize(rows, cols);
+    return mapped_file_read(arr.data, (size_t)rows * cols * sizeof(T), file, offset);
+}
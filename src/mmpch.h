@@ -13,9 +13,12 @@ extern "C"
 
 #include <initializer_list>
 #include <functional>
+#include <algorithm>
 #include <assert.h>
 #include <stdio.h>
 #include <float.h>
+#include <limits.h>
+#include <stdint.h>
 #include <math.h>
 
 #include <vector>
@@ -1,5 +1,11 @@
 #include "mmpch.h"
 #include "nnet.h"
+#include "container.h"
+#include "simd.h"
+#include "nnet_kernel.h"
+#include "nnet_static.h"
+
+#include <chrono>
 
 
 void nnet_load(nnet& nn, const char* filename)
@@ -24,9 +30,506 @@ void nnet_load(nnet& nn, const char* filename)
 		array1d_read(nn.biases[i], f);
 	}
 
+	nn.weights_quantized.clear();
+	nn.weights_scale.clear();
+	nn.first_biases_quantized.resize(0);
+	nn.folded = false;
+
 	fclose(f);
+
+	nnet_fold_normalization(nn);
+	nnet_pack(nn);
+}
+
+void nnet_fold_normalization(nnet& nn)
+{
+	if (nn.folded) { return; }
+
+	// Inputs are normalized as (x - mean) / std so the weights
+	// of the first layer are divided by std and the bias takes
+	// the part coming from the mean
+
+	array2d<float>& first_weights = nn.weights.front();
+	array1d<float>& first_biases = nn.biases.front();
+
+	for (int j = 0; j < first_weights.cols; j++)
+	{
+		for (int i = 0; i < first_weights.rows; i++)
+		{
+			first_biases(j) -= (nn.input_mean(i) / nn.input_std(i)) * first_weights(i, j);
+		}
+	}
+
+	for (int i = 0; i < first_weights.rows; i++)
+	{
+		for (int j = 0; j < first_weights.cols; j++)
+		{
+			first_weights(i, j) /= nn.input_std(i);
+		}
+	}
+
+	// Outputs are denormalized as y * std + mean so everything
+	// going into the last layer is scaled by std
+
+	array2d<float>& last_weights = nn.weights.back();
+	array1d<float>& last_biases = nn.biases.back();
+
+	for (int j = 0; j < last_weights.cols; j++)
+	{
+		last_biases(j) = last_biases(j) * nn.output_std(j) + nn.output_mean(j);
+	}
+
+	for (int i = 0; i < last_weights.rows; i++)
+	{
+		for (int j = 0; j < last_weights.cols; j++)
+		{
+			last_weights(i, j) *= nn.output_std(j);
+		}
+	}
+
+	// The quantized first layer stays unfolded (see `nnet_quantize`)
+	// but the last layer has to be denormalized in the same way, 
+	// which only needs the scale of each output
+	if (!nn.weights_quantized.empty())
+	{
+		array1d<float>& last_scale = nn.weights_scale.back();
+
+		for (int j = 0; j < last_scale.size; j++)
+		{
+			last_scale(j) *= nn.output_std(j);
+		}
+	}
+
+	nn.folded = true;
+}
+
+// The quantized first layer takes normalized inputs so the part
+// of the folded biases coming from the input mean is added back
+static void nnet_quantize_first_biases(nnet& nn)
+{
+	const array2d<float>& first_weights = nn.weights.front();
+	nn.first_biases_quantized = nn.biases.front();
+
+	if (!nn.folded) { return; }
+
+	for (int j = 0; j < first_weights.cols; j++)
+	{
+		for (int i = 0; i < first_weights.rows; i++)
+		{
+			nn.first_biases_quantized(j) += nn.input_mean(i) * first_weights(i, j);
+		}
+	}
+}
+
+bool nnet_save_container(const nnet& nn, const char* filename)
+{
+	container_writer w;
+	if (!container_writer_open(w, filename)) { return false; }
+
+	container_write_array1d(w, "input_mean", nn.input_mean);
+	container_write_array1d(w, "input_std", nn.input_std);
+	container_write_array1d(w, "output_mean", nn.output_mean);
+	container_write_array1d(w, "output_std", nn.output_std);
+
+	array1d<int> count(1);
+	count(0) = (int)nn.weights.size();
+	container_write_array1d(w, "count", count);
+
+	array1d<int> folded(1);
+	folded(0) = nn.folded ? 1 : 0;
+	container_write_array1d(w, "folded", folded);
+
+	char name[CONTAINER_NAME_SIZE];
+	for (int i = 0; i < count(0); i++)
+	{
+		snprintf(name, CONTAINER_NAME_SIZE, "weights%i", i);
+		container_write_array2d(w, name, nn.weights[i]);
+		snprintf(name, CONTAINER_NAME_SIZE, "biases%i", i);
+		container_write_array1d(w, name, nn.biases[i]);
+	}
+
+	for (int i = 0; i < (int)nn.weights_quantized.size(); i++)
+	{
+		snprintf(name, CONTAINER_NAME_SIZE, "weights_quantized%i", i);
+		container_write_array2d(w, name, nn.weights_quantized[i]);
+		snprintf(name, CONTAINER_NAME_SIZE, "weights_scale%i", i);
+		container_write_array1d(w, name, nn.weights_scale[i]);
+	}
+
+	return container_writer_close(w);
+}
+
+bool nnet_load_container(nnet& nn, const char* filename, const bool verify)
+{
+	container c;
+	if (!container_open(c, filename)) { return false; }
+	if (verify && !container_verify(c)) { return false; }
+
+	array1d<int> count;
+	bool found = 
+		container_read_array1d(nn.input_mean, c, "input_mean") &&
+		container_read_array1d(nn.input_std, c, "input_std") &&
+		container_read_array1d(nn.output_mean, c, "output_mean") &&
+		container_read_array1d(nn.output_std, c, "output_std") &&
+		container_read_array1d(count, c, "count") &&
+		count.size == 1;
+
+	if (!found) { return false; }
+
+	nn.weights.resize(count(0));
+	nn.biases.resize(count(0));
+
+	char name[CONTAINER_NAME_SIZE];
+	for (int i = 0; i < count(0); i++)
+	{
+		snprintf(name, CONTAINER_NAME_SIZE, "weights%i", i);
+		found = found && container_read_array2d(nn.weights[i], c, name);
+		snprintf(name, CONTAINER_NAME_SIZE, "biases%i", i);
+		found = found && container_read_array1d(nn.biases[i], c, name);
+	}
+
+	// Containers saved before folding was added don't have this and
+	// are folded once everything is read, including any int8 weights
+	array1d<int> folded;
+	nn.folded = found && container_read_array1d(folded, c, "folded") && folded.size == 1 && folded(0) == 1;
+
+	// Quantized weights are only there if saved after `nnet_quantize`
+	nn.weights_quantized.clear();
+	nn.weights_scale.clear();
+	nn.first_biases_quantized.resize(0);
+
+	snprintf(name, CONTAINER_NAME_SIZE, "weights_quantized%i", 0);
+	if (found && container_find(c, name) != nullptr)
+	{
+		nn.weights_quantized.resize(count(0));
+		nn.weights_scale.resize(count(0));
+
+		for (int i = 0; i < count(0); i++)
+		{
+			snprintf(name, CONTAINER_NAME_SIZE, "weights_quantized%i", i);
+			found = found && container_read_array2d(nn.weights_quantized[i], c, name);
+			snprintf(name, CONTAINER_NAME_SIZE, "weights_scale%i", i);
+			found = found && container_read_array1d(nn.weights_scale[i], c, name);
+		}
+	}
+
+	if (found)
+	{
+		nnet_fold_normalization(nn);
+		nnet_pack(nn);
+
+		if (!nn.weights_quantized.empty())
+		{
+			nnet_quantize_first_biases(nn);
+		}
+	}
+
+	return found;
 }
 
+bool nnet_convert_container(const char* nnet_filename, const char* filename)
+{
+	nnet nn;
+	nnet_load(nn, nnet_filename);
+	return nnet_save_container(nn, filename);
+}
+
+
+//--------------------------------------
+
+// Kernels for the dot product of two int8 vectors whose
+// size is a multiple of NNET_QUANTIZED_PAD, accumulated 
+// as int32. The SIMD versions sign extend to int16 and 
+// use multiply-add of pairs into int32 lanes.
+
+struct nnet_quantized_kernel_scalar
+{
+	static inline int dot(
+		const signed char* RESTRICT a,
+		const signed char* RESTRICT b,
+		const int size)
+	{
+		int acc = 0;
+		for (int i = 0; i < size; i++)
+		{
+			acc += (int)a[i] * (int)b[i];
+		}
+		return acc;
+	}
+};
+
+#if defined(SIMD_X64)
+
+struct nnet_quantized_kernel_sse
+{
+	static inline __m128i widen_lo(const __m128i x)
+	{
+		return _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+	}
+
+	static inline __m128i widen_hi(const __m128i x)
+	{
+		return _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+	}
+
+	static inline int dot(
+		const signed char* RESTRICT a,
+		const signed char* RESTRICT b,
+		const int size)
+	{
+		__m128i acc = _mm_setzero_si128();
+		for (int i = 0; i < size; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(widen_lo(va), widen_lo(vb)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(widen_hi(va), widen_hi(vb)));
+		}
+
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(acc);
+	}
+};
+
+struct nnet_quantized_kernel_avx2
+{
+	SIMD_TARGET_AVX2 static inline int dot(
+		const signed char* RESTRICT a,
+		const signed char* RESTRICT b,
+		const int size)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		for (int i = 0; i < size; i += 32)
+		{
+			__m256i va0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+			__m256i vb0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+			__m256i va1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16)));
+			__m256i vb1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)));
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va0, vb0));
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va1, vb1));
+		}
+
+		__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(s);
+	}
+};
+
+#endif
+
+template<typename K>
+static void nnet_layer_linear_quantized_kernel(
+	slice1d<float> output,
+	const slice1d<signed char> input,
+	const float input_scale,
+	const slice2d<signed char> weights,
+	const slice1d<float> weights_scale,
+	const slice1d<float> biases)
+{
+	for (int j = 0; j < output.size; j++)
+	{
+		int acc = K::dot(input.data, &weights.data[j * weights.cols], weights.cols);
+		output(j) = biases(j) + (float)acc * input_scale * weights_scale(j);
+	}
+}
+
+// Same as `nnet_layer_linear` but with int8 weights. The input 
+// is quantized using a single scale covering its largest value.
+static void nnet_layer_linear_quantized(
+	slice1d<float> output,
+	slice1d<signed char> quantized,
+	const slice1d<float> input,
+	const slice2d<signed char> weights,
+	const slice1d<float> weights_scale,
+	const slice1d<float> biases)
+{
+	assert(quantized.size >= weights.cols && weights.rows == output.size);
+
+	float input_max = 0.0f;
+	for (int i = 0; i < input.size; i++)
+	{
+		input_max = maxf(input_max, fabsf(input(i)));
+	}
+
+	float input_scale = input_max / 127.0f;
+	float input_scale_inv = input_max > 0.0f ? 127.0f / input_max : 0.0f;
+
+	for (int i = 0; i < input.size; i++)
+	{
+		quantized(i) = (signed char)clampf(roundf(input(i) * input_scale_inv), -127.0f, 127.0f);
+	}
+
+	// Padding of the weights is zero but clear it here too
+	for (int i = input.size; i < weights.cols; i++)
+	{
+		quantized(i) = 0;
+	}
+
+	switch (simd_get_level())
+	{
+#if defined(SIMD_X64)
+	case SIMD_AVX2: nnet_layer_linear_quantized_kernel<nnet_quantized_kernel_avx2>(output, quantized, input_scale, weights, weights_scale, biases); break;
+	case SIMD_SSE: nnet_layer_linear_quantized_kernel<nnet_quantized_kernel_sse>(output, quantized, input_scale, weights, weights_scale, biases); break;
+#endif
+	default: nnet_layer_linear_quantized_kernel<nnet_quantized_kernel_scalar>(output, quantized, input_scale, weights, weights_scale, biases); break;
+	}
+}
+
+void nnet_quantize(nnet& nn)
+{
+	int nlayers = (int)nn.weights.size();
+	nn.weights_quantized.resize(nlayers);
+	nn.weights_scale.resize(nlayers);
+
+	for (int l = 0; l < nlayers; l++)
+	{
+		const array2d<float>& weights = nn.weights[l];
+		int padded = ((weights.rows + NNET_QUANTIZED_PAD - 1) / NNET_QUANTIZED_PAD) * NNET_QUANTIZED_PAD;
+
+		nn.weights_quantized[l].resize(weights.cols, padded);
+		nn.weights_scale[l].resize(weights.cols);
+		nn.weights_quantized[l].zero();
+
+		// Undo the folding of the input normalization
+		array1d<float> input_scale(weights.rows);
+		for (int i = 0; i < weights.rows; i++)
+		{
+			input_scale(i) = l == 0 && nn.folded ? nn.input_std(i) : 1.0f;
+		}
+
+		for (int j = 0; j < weights.cols; j++)
+		{
+			float weight_max = 0.0f;
+			for (int i = 0; i < weights.rows; i++)
+			{
+				weight_max = maxf(weight_max, fabsf(weights(i, j) * input_scale(i)));
+			}
+
+			float scale = weight_max / 127.0f;
+			nn.weights_scale[l](j) = scale;
+
+			for (int i = 0; i < weights.rows; i++)
+			{
+				float code = scale > 0.0f ? roundf((weights(i, j) * input_scale(i)) / scale) : 0.0f;
+				nn.weights_quantized[l](j, i) = (signed char)clampf(code, -127.0f, 127.0f);
+			}
+		}
+	}
+
+	nnet_quantize_first_biases(nn);
+}
+
+//--------------------------------------
+
+void nnet_pack(nnet& nn)
+{
+	int nlayers = (int)nn.weights.size();
+	nn.weights_packed.resize(nlayers);
+
+	for (int l = 0; l < nlayers; l++)
+	{
+		const array2d<float>& weights = nn.weights[l];
+		int npanels = (weights.cols + NNET_PANEL_COLS - 1) / NNET_PANEL_COLS;
+
+		nn.weights_packed[l].resize(npanels, weights.rows * NNET_PANEL_COLS);
+		nn.weights_packed[l].zero();
+
+		for (int p = 0; p < npanels; p++)
+		{
+			for (int i = 0; i < weights.rows; i++)
+			{
+				for (int k = 0; k < NNET_PANEL_COLS && p * NNET_PANEL_COLS + k < weights.cols; k++)
+				{
+					nn.weights_packed[l](p, i * NNET_PANEL_COLS + k) = weights(i, p * NNET_PANEL_COLS + k);
+				}
+			}
+		}
+	}
+}
+
+// Same as `nnet_layer_linear` but using the packed weights
+static void nnet_layer_linear_packed(
+	slice1d<float> output,
+	const slice1d<float> input,
+	const slice2d<float> weights_packed,
+	const slice1d<float> biases)
+{
+	assert(weights_packed.cols == input.size * NNET_PANEL_COLS && weights_packed.rows == nnet_kernel_npanels(output.size));
+
+	nnet_kernel_dispatch([&](auto kernel)
+	{
+		nnet_kernel_layer<decltype(kernel), false>(
+			output.data, 
+			input.data, 
+			input.size, 
+			output.size, 
+			weights_packed.data, 
+			biases.data);
+	});
+}
+
+//--------------------------------------
+
+static void nnet_evaluate_weights(
+	nnet_evaluation& evaluation,
+	const nnet& nn,
+	const bool quantized)
+{
+	// The quantized first layer always takes normalized inputs
+	if (!nn.folded || quantized)
+	{
+		nnet_layer_normalize(
+			evaluation.layers.front(),
+			nn.input_mean,
+			nn.input_std);
+	}
+
+	for (int i = 0; i < nn.weights.size(); i++)
+	{
+		if (quantized)
+		{
+			nnet_layer_linear_quantized(
+				evaluation.layers[i + 1],
+				evaluation.quantized,
+				evaluation.layers[i],
+				nn.weights_quantized[i],
+				nn.weights_scale[i],
+				i == 0 ? nn.first_biases_quantized : nn.biases[i]);
+		}
+		else if (!nn.weights_packed.empty())
+		{
+			nnet_layer_linear_packed(
+				evaluation.layers[i + 1],
+				evaluation.layers[i],
+				nn.weights_packed[i],
+				nn.biases[i]);
+		}
+		else
+		{
+			nnet_layer_linear(
+				evaluation.layers[i + 1],
+				evaluation.layers[i],
+				nn.weights[i],
+				nn.biases[i]);
+		}
+
+		// No relu for final layer
+		if (i != nn.weights.size() - 1)
+		{
+			nnet_layer_relu(evaluation.layers[i + 1]);
+		}
+	}
+
+	if (!nn.folded)
+	{
+		nnet_layer_denormalize(
+			evaluation.layers.back(),
+			nn.output_mean,
+			nn.output_std);
+	}
+}
 
 // Neural Network evaluation function. Assumes input 
 // has been placed in first layer of `evaulation` 
@@ -36,29 +539,128 @@ void nnet_evaluate(
 	nnet_evaluation& evaluation,
 	const nnet& nn)
 {
-	nnet_layer_normalize(
-		evaluation.layers.front(),
-		nn.input_mean,
-		nn.input_std);
+	bool quantized = !nn.weights_quantized.empty();
 
-	for (int i = 0; i < nn.weights.size(); i++)
+	// Use the specialized version for networks of known shape
+	if (!quantized && nnet_static_decompressor::matches(nn)) { nnet_static_decompressor::evaluate(evaluation, nn); return; }
+	if (!quantized && nnet_static_stepper::matches(nn)) { nnet_static_stepper::evaluate(evaluation, nn); return; }
+	if (!quantized && nnet_static_projector::matches(nn)) { nnet_static_projector::evaluate(evaluation, nn); return; }
+
+	nnet_evaluate_weights(evaluation, nn, quantized);
+}
+
+void nnet_evaluate_batch(
+	nnet_evaluation_batch& evaluation,
+	const nnet& nn)
+{
+	if (!nn.folded)
+	{
+		nnet_layer_normalize_batch(
+			evaluation.layers.front(),
+			nn.input_mean,
+			nn.input_std);
+	}
+
+	int nlayers = (int)nn.weights.size();
+
+	for (int i = 0; i < nlayers; i++)
 	{
-		nnet_layer_linear(
+		nnet_layer_linear_batch(
 			evaluation.layers[i + 1],
 			evaluation.layers[i],
 			nn.weights[i],
 			nn.biases[i]);
 
 		// No relu for final layer
-		if (i != nn.weights.size() - 1)
+		if (i != nlayers - 1)
 		{
-			nnet_layer_relu(evaluation.layers[i + 1]);
+			nnet_layer_relu_batch(evaluation.layers[i + 1]);
 		}
 	}
 
-	nnet_layer_denormalize(
-		evaluation.layers.back(),
-		nn.output_mean,
-		nn.output_std);
+	if (!nn.folded)
+	{
+		nnet_layer_denormalize_batch(
+			evaluation.layers.back(),
+			nn.output_mean,
+			nn.output_std);
+	}
 }
 
+void nnet_quantized_error(
+	float& mean_error,
+	float& max_error,
+	nnet_evaluation& evaluation,
+	const nnet& nn,
+	const slice2d<float> inputs)
+{
+	assert(!nn.weights_quantized.empty());
+
+	int noutputs = nn.output_std.size;
+	array1d<float> output(noutputs);
+
+	mean_error = 0.0f;
+	max_error = 0.0f;
+
+	for (int r = 0; r < inputs.rows; r++)
+	{
+		evaluation.layers.front() = inputs(r);
+		nnet_evaluate_weights(evaluation, nn, false);
+		output = evaluation.layers.back();
+
+		evaluation.layers.front() = inputs(r);
+		nnet_evaluate_weights(evaluation, nn, true);
+
+		for (int j = 0; j < noutputs; j++)
+		{
+			// Constant outputs have zero std so use the absolute error
+			float error = fabsf(evaluation.layers.back()(j) - output(j));
+			error = nn.output_std(j) > 0.0f ? error / nn.output_std(j) : error;
+			mean_error += error / (inputs.rows * noutputs);
+			max_error = maxf(max_error, error);
+		}
+	}
+}
+
+void nnet_benchmark(
+	slice1d<float> gflops_reference,
+	slice1d<float> gflops_packed,
+	nnet_evaluation& evaluation,
+	const nnet& nn,
+	const int iterations)
+{
+	int nlayers = (int)nn.weights.size();
+
+	assert(gflops_reference.size == nlayers && gflops_packed.size == nlayers);
+	assert(!nn.weights_packed.empty());
+
+	// Evaluate once so every layer has realistic activations,
+	// which are left as they are by writing to a scratch output
+	nnet_evaluate_weights(evaluation, nn, false);
+
+	for (int l = 0; l < nlayers; l++)
+	{
+		float flops = 2.0f * nn.weights[l].rows * nn.weights[l].cols * iterations;
+
+		array1d<float> output(nn.weights[l].cols);
+
+		auto t0 = std::chrono::high_resolution_clock::now();
+
+		for (int it = 0; it < iterations; it++)
+		{
+			nnet_layer_linear(output, evaluation.layers[l], nn.weights[l], nn.biases[l]);
+		}
+
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		for (int it = 0; it < iterations; it++)
+		{
+			nnet_layer_linear_packed(output, evaluation.layers[l], nn.weights_packed[l], nn.biases[l]);
+		}
+
+		auto t2 = std::chrono::high_resolution_clock::now();
+
+		gflops_reference(l) = flops / std::chrono::duration<float, std::nano>(t1 - t0).count();
+		gflops_packed(l) = flops / std::chrono::duration<float, std::nano>(t2 - t1).count();
+	}
+}
@@ -12,6 +12,14 @@
 
 //--------------------------------------
 
+enum
+{
+    NNET_BATCH_ROWS = 4,
+    NNET_BATCH_COLS = 128,
+    NNET_QUANTIZED_PAD = 32,
+    NNET_PANEL_COLS = 16,
+};
+
 // Very basic feed-forward neural network
 // class. Assumes relu activation on every
 // layer except the last. Also includes 
@@ -25,10 +33,70 @@ struct nnet
     array1d<float> output_std;
     std::vector<array2d<float>> weights;
     std::vector<array1d<float>> biases;
+    
+    // Set by `nnet_fold_normalization` once the input and output
+    // normalization are part of the first and last layer. The 
+    // mean and std are kept but no longer applied.
+    bool folded = false;
+    
+    // Copy of the weights made by `nnet_pack` split into panels 
+    // of NNET_PANEL_COLS outputs. Each panel is stored as a row 
+    // with the weights of every input to those outputs one after 
+    // the other, padded with zeros in the last panel.
+    std::vector<array2d<float>> weights_packed;
+    
+    // Optional int8 copy of the weights made by `nnet_quantize`
+    // and used by `nnet_evaluate` when present. Each layer is
+    // stored transposed, with one row per output padded with
+    // zeros to a multiple of NNET_QUANTIZED_PAD inputs, along 
+    // with the scale of each output.
+    std::vector<array2d<signed char>> weights_quantized;
+    std::vector<array1d<float>> weights_scale;
+    
+    // The quantized first layer is applied to normalized inputs
+    // rather than having the normalization folded in, so has its
+    // own biases, computed by `nnet_quantize` or on load.
+    array1d<float> first_biases_quantized;
 };
 
+// Loads the network, folds the normalization into the weights
+// with `nnet_fold_normalization` and packs them with `nnet_pack`
 void nnet_load(nnet& nn, const char* filename);
 
+// Fold the normalization of the inputs into the weights and
+// biases of the first layer and the denormalization of the
+// outputs into the last layer so that evaluation is only
+// linear layers and relu. The scales of the last layer of any
+// int8 weights are folded too. Does nothing if already folded.
+void nnet_fold_normalization(nnet& nn);
+
+// Repack the weights into panels for `nnet_evaluate`. Must be
+// called again if the weights are changed after loading.
+void nnet_pack(nnet& nn);
+
+// Post-training quantization of the weights to int8 with a 
+// symmetric scale per output. Activations are quantized on 
+// the fly with a single scale for each layer input, and the
+// products accumulated as int32 before being scaled back. The
+// float weights are kept for `nnet_evaluate_batch`.
+//
+// The first layer is quantized from the weights without the 
+// input normalization folded in, as folding divides each input
+// by its std, so a few inputs with a small std would take up 
+// most of the range of each output's scale. Inputs are then
+// normalized before the quantized first layer instead.
+void nnet_quantize(nnet& nn);
+
+// Save or load the network as a container (see `container.h`).
+// Saving returns false if the file could not be written. Loading
+// returns false if the file cannot be opened or a chunk is 
+// missing, or if `verify` is set and a checksum does not match.
+bool nnet_save_container(const nnet& nn, const char* filename);
+bool nnet_load_container(nnet& nn, const char* filename, const bool verify = false);
+
+// Convert a network in the original format to a container
+bool nnet_convert_container(const char* nnet_filename, const char* filename);
+
 //--------------------------------------
 
 static inline void nnet_layer_normalize(
@@ -94,6 +162,111 @@ static inline void nnet_layer_relu(slice1d<float> output)
 
 //--------------------------------------
 
+// Batched versions of the layers, with one input per row
+
+static inline void nnet_layer_normalize_batch(
+    slice2d<float> output,
+    const slice1d<float> mean,
+    const slice1d<float> std)
+{
+    for (int b = 0; b < output.rows; b++)
+    {
+        nnet_layer_normalize(output(b), mean, std);
+    }
+}
+
+static inline void nnet_layer_denormalize_batch(
+    slice2d<float> output,
+    const slice1d<float> mean,
+    const slice1d<float> std)
+{
+    for (int b = 0; b < output.rows; b++)
+    {
+        nnet_layer_denormalize(output(b), mean, std);
+    }
+}
+
+// Matrix-matrix version of `nnet_layer_linear`. Each block of 
+// NNET_BATCH_ROWS inputs is multiplied by the weights in strips 
+// of NNET_BATCH_COLS outputs, so every row of the weights that 
+// is loaded gets used for several inputs while the outputs being
+// accumulated stay in cache. Rows of the weights are only skipped
+// when the activation is zero for every input in the block, as 
+// with larger blocks this happens less often. The accumulation
+// order is the same as `nnet_layer_linear` so each row gives 
+// the same result as evaluating it alone.
+static inline void nnet_layer_linear_batch(
+    slice2d<float> output,
+    const slice2d<float> input,
+    const slice2d<float> weights,
+    const slice1d<float> biases)
+{
+    assert(output.rows == input.rows);
+    
+    int b = 0;
+    for (; b + NNET_BATCH_ROWS <= input.rows; b += NNET_BATCH_ROWS)
+    {
+        const float* RESTRICT input0 = &input.data[(b + 0) * input.cols];
+        const float* RESTRICT input1 = &input.data[(b + 1) * input.cols];
+        const float* RESTRICT input2 = &input.data[(b + 2) * input.cols];
+        const float* RESTRICT input3 = &input.data[(b + 3) * input.cols];
+        
+        for (int j0 = 0; j0 < output.cols; j0 += NNET_BATCH_COLS)
+        {
+            int j1 = j0 + NNET_BATCH_COLS < output.cols ? j0 + NNET_BATCH_COLS : output.cols;
+            
+            float* RESTRICT output0 = &output.data[(b + 0) * output.cols];
+            float* RESTRICT output1 = &output.data[(b + 1) * output.cols];
+            float* RESTRICT output2 = &output.data[(b + 2) * output.cols];
+            float* RESTRICT output3 = &output.data[(b + 3) * output.cols];
+            
+            for (int j = j0; j < j1; j++)
+            {
+                output0[j] = biases.data[j];
+                output1[j] = biases.data[j];
+                output2[j] = biases.data[j];
+                output3[j] = biases.data[j];
+            }
+            
+            for (int i = 0; i < input.cols; i++)
+            {
+                float x0 = input0[i], x1 = input1[i], x2 = input2[i], x3 = input3[i];
+                
+                if (x0 == 0.0f && x1 == 0.0f && x2 == 0.0f && x3 == 0.0f)
+                {
+                    continue;
+                }
+                
+                const float* RESTRICT w = &weights.data[i * weights.cols];
+                
+                for (int j = j0; j < j1; j++)
+                {
+                    output0[j] += x0 * w[j];
+                    output1[j] += x1 * w[j];
+                    output2[j] += x2 * w[j];
+                    output3[j] += x3 * w[j];
+                }
+            }
+        }
+    }
+    
+    // Remaining rows one at a time
+    for (; b < input.rows; b++)
+    {
+        nnet_layer_linear(output(b), input(b), weights, biases);
+    }
+}
+
+static inline void nnet_layer_relu_batch(slice2d<float> output)
+{
+    for (int i = 0; i < output.rows * output.cols; i++)
+    {
+        output.data[i] = maxf(output.data[i], 0.0f);
+    }
+}
+
+//--------------------------------------
+
 // Basic class that can be used to pre-allocate 
 // the storage required to do network inference 
 // (i.e. activations).
@@ -101,23 +274,89 @@ struct nnet_evaluation
 {
     std::vector<array1d<float>> layers;
     
+    // Quantized input of the current layer when 
+    // evaluating with int8 weights
+    array1d<signed char> quantized;
+    
     // Resize for a given network
     void resize(const nnet& nn)
     {
         layers.resize(nn.weights.size() + 1);
         layers.front().resize(nn.weights.front().rows);
       
+        int quantized_size = 0;
         for (int i = 0; i < nn.weights.size(); i++)
         {
             layers[i+1].resize(nn.weights[i].cols);            
+            
+            int padded = ((nn.weights[i].rows + NNET_QUANTIZED_PAD - 1) / NNET_QUANTIZED_PAD) * NNET_QUANTIZED_PAD;
+            quantized_size = padded > quantized_size ? padded : quantized_size;
         }
+        
+        quantized.resize(quantized_size);
+        quantized.zero();
     }
 };
 
 // Neural Network evaluation function. Assumes input 
 // has been placed in first layer of `evaulation` 
 // object. Puts result in the last layer of the 
-// `evaluation` object.
+// `evaluation` object. Uses the int8 weights if
+// the network has been quantized, otherwise the
+// packed weights, which give the same result as
+// `nnet_layer_linear`.
 void nnet_evaluate(
     nnet_evaluation& evaluation,
+    const nnet& nn);
+
+// Measures the speed of each layer in GFLOP/s (counting every
+// weight as a multiply and add) for `nnet_layer_linear` and for
+// the packed weights with the current instruction set. Assumes
+// input has been placed in the first layer of `evaluation` so
+// that activations skipped due to relu are realistic.
+void nnet_benchmark(
+    slice1d<float> gflops_reference,
+    slice1d<float> gflops_packed,
+    nnet_evaluation& evaluation,
+    const nnet& nn,
+    const int iterations = 1000);
+
+// Measure the error of a quantized network against its float
+// weights for each row of `inputs`, in units of the standard 
+// deviation of each output.
+void nnet_quantized_error(
+    float& mean_error,
+    float& max_error,
+    nnet_evaluation& evaluation,
+    const nnet& nn,
+    const slice2d<float> inputs);
+
+// Same as `nnet_evaluation` but for a batch of inputs,
+// e.g. one per character, each stored in a row
+struct nnet_evaluation_batch
+{
+    std::vector<array2d<float>> layers;
+    
+    // Resize for a given network and batch size
+    void resize(const nnet& nn, const int nbatch)
+    {
+        int nlayers = (int)nn.weights.size();
+        
+        layers.resize(nlayers + 1);
+        layers.front().resize(nbatch, nn.weights.front().rows);
+      
+        for (int i = 0; i < nlayers; i++)
+        {
+            layers[i+1].resize(nbatch, nn.weights[i].cols);            
+        }
+    }
+    
+    int nbatch() const { return layers.front().rows; }
+};
+
+// Batched version of `nnet_evaluate` which gives the same
+// result for each row as evaluating it on its own, but only
+// goes through the weights once per block of inputs.
+void nnet_evaluate_batch(
+    nnet_evaluation_batch& evaluation,
     const nnet& nn);
\ No newline at end of file
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "mmpch.h"
+#include "nnet.h"
+#include "simd.h"
+
+//--------------------------------------
+
+// The kernels below multiply the input by one panel of packed
+// weights (see `nnet_pack`), accumulating into a tile of
+// NNET_PANEL_COLS outputs which is kept in registers. The
+// multiply and add are done separately, in the same order as
+// `nnet_layer_linear`, so the result is exactly the same.
+//
+// The number of inputs `N` is either an `int` or, for layers
+// whose size is known at compile time (see `nnet_static.h`), a
+// `std::integral_constant` so that the loop bound is constant.
+
+struct nnet_kernel_scalar
+{
+    template<typename N>
+    static inline void panel(
+        float* RESTRICT tile,
+        const float* RESTRICT input,
+        const N ninputs,
+        const float* RESTRICT weights)
+    {
+        float acc[NNET_PANEL_COLS];
+        for (int k = 0; k < NNET_PANEL_COLS; k++)
+        {
+            acc[k] = tile[k];
+        }
+
+        for (int i = 0; i < ninputs; i++)
+        {
+            float x = input[i];
+            if (x != 0.0f)
+            {
+                const float* RESTRICT w = &weights[i * NNET_PANEL_COLS];
+                for (int k = 0; k < NNET_PANEL_COLS; k++)
+                {
+                    acc[k] += x * w[k];
+                }
+            }
+        }
+
+        for (int k = 0; k < NNET_PANEL_COLS; k++)
+        {
+            tile[k] = acc[k];
+        }
+    }
+};
+
+#if defined(SIMD_X64)
+
+struct nnet_kernel_sse
+{
+    template<typename N>
+    static inline void panel(
+        float* RESTRICT tile,
+        const float* RESTRICT input,
+        const N ninputs,
+        const float* RESTRICT weights)
+    {
+        __m128 acc0 = _mm_loadu_ps(tile + 0);
+        __m128 acc1 = _mm_loadu_ps(tile + 4);
+        __m128 acc2 = _mm_loadu_ps(tile + 8);
+        __m128 acc3 = _mm_loadu_ps(tile + 12);
+
+        for (int i = 0; i < ninputs; i++)
+        {
+            if (input[i] != 0.0f)
+            {
+                __m128 x = _mm_set1_ps(input[i]);
+                const float* RESTRICT w = &weights[i * NNET_PANEL_COLS];
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(x, _mm_loadu_ps(w + 0)));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(x, _mm_loadu_ps(w + 4)));
+                acc2 = _mm_add_ps(acc2, _mm_mul_ps(x, _mm_loadu_ps(w + 8)));
+                acc3 = _mm_add_ps(acc3, _mm_mul_ps(x, _mm_loadu_ps(w + 12)));
+            }
+        }
+
+        _mm_storeu_ps(tile + 0, acc0);
+        _mm_storeu_ps(tile + 4, acc1);
+        _mm_storeu_ps(tile + 8, acc2);
+        _mm_storeu_ps(tile + 12, acc3);
+    }
+};
+
+struct nnet_kernel_avx2
+{
+    template<typename N>
+    SIMD_TARGET_AVX2 static inline void panel(
+        float* RESTRICT tile,
+        const float* RESTRICT input,
+        const N ninputs,
+        const float* RESTRICT weights)
+    {
+        __m256 acc0 = _mm256_loadu_ps(tile + 0);
+        __m256 acc1 = _mm256_loadu_ps(tile + 8);
+
+        for (int i = 0; i < ninputs; i++)
+        {
+            if (input[i] != 0.0f)
+            {
+                __m256 x = _mm256_set1_ps(input[i]);
+                const float* RESTRICT w = &weights[i * NNET_PANEL_COLS];
+                acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(x, _mm256_loadu_ps(w + 0)));
+                acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(x, _mm256_loadu_ps(w + 8)));
+            }
+        }
+
+        _mm256_storeu_ps(tile + 0, acc0);
+        _mm256_storeu_ps(tile + 8, acc1);
+    }
+};
+
+#endif
+
+#if defined(SIMD_NEON)
+
+struct nnet_kernel_neon
+{
+    template<typename N>
+    static inline void panel(
+        float* RESTRICT tile,
+        const float* RESTRICT input,
+        const N ninputs,
+        const float* RESTRICT weights)
+    {
+        float32x4_t acc0 = vld1q_f32(tile + 0);
+        float32x4_t acc1 = vld1q_f32(tile + 4);
+        float32x4_t acc2 = vld1q_f32(tile + 8);
+        float32x4_t acc3 = vld1q_f32(tile + 12);
+
+        for (int i = 0; i < ninputs; i++)
+        {
+            if (input[i] != 0.0f)
+            {
+                float32x4_t x = vdupq_n_f32(input[i]);
+                const float* RESTRICT w = &weights[i * NNET_PANEL_COLS];
+                acc0 = vaddq_f32(acc0, vmulq_f32(x, vld1q_f32(w + 0)));
+                acc1 = vaddq_f32(acc1, vmulq_f32(x, vld1q_f32(w + 4)));
+                acc2 = vaddq_f32(acc2, vmulq_f32(x, vld1q_f32(w + 8)));
+                acc3 = vaddq_f32(acc3, vmulq_f32(x, vld1q_f32(w + 12)));
+            }
+        }
+
+        vst1q_f32(tile + 0, acc0);
+        vst1q_f32(tile + 4, acc1);
+        vst1q_f32(tile + 8, acc2);
+        vst1q_f32(tile + 12, acc3);
+    }
+};
+
+#endif
+
+// Calls `f` with the kernel for the current instruction set
+template<typename F>
+static inline void nnet_kernel_dispatch(F&& f)
+{
+    switch (simd_get_level())
+    {
+#if defined(SIMD_X64)
+    case SIMD_AVX2: f(nnet_kernel_avx2()); break;
+    case SIMD_SSE: f(nnet_kernel_sse()); break;
+#elif defined(SIMD_NEON)
+    case SIMD_NEON: f(nnet_kernel_neon()); break;
+#endif
+    default: f(nnet_kernel_scalar()); break;
+    }
+}
+
+//--------------------------------------
+
+static constexpr int nnet_kernel_npanels(const int noutputs)
+{
+    return (noutputs + NNET_PANEL_COLS - 1) / NNET_PANEL_COLS;
+}
+
+// Bias, matmul and (optionally) relu for a whole layer using the
+// packed weights, one panel at a time. As with `panel` the sizes
+// can be `int` or `std::integral_constant`.
+template<typename K, bool Relu, typename N, typename M>
+static inline void nnet_kernel_layer(
+    float* RESTRICT output,
+    const float* RESTRICT input,
+    const N ninputs,
+    const M noutputs,
+    const float* RESTRICT weights_packed,
+    const float* RESTRICT biases)
+{
+    for (int p = 0; p < nnet_kernel_npanels(noutputs); p++)
+    {
+        int j0 = p * NNET_PANEL_COLS;
+        int count = noutputs - j0 < NNET_PANEL_COLS ? noutputs - j0 : NNET_PANEL_COLS;
+
+        float tile[NNET_PANEL_COLS];
+        for (int k = 0; k < NNET_PANEL_COLS; k++)
+        {
+            tile[k] = k < count ? biases[j0 + k] : 0.0f;
+        }
+
+        K::panel(tile, input, ninputs, &weights_packed[p * ninputs * NNET_PANEL_COLS]);
+
+        for (int k = 0; k < count; k++)
+        {
+            output[j0 + k] = Relu ? maxf(tile[k], 0.0f) : tile[k];
+        }
+    }
+}
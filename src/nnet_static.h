@@ -0,0 +1,115 @@
+#pragma once
+
+#include "mmpch.h"
+#include "nnet.h"
+#include "nnet_kernel.h"
+
+#include <type_traits>
+#include <utility>
+
+//--------------------------------------
+
+// Evaluation of a network whose layer sizes are known at compile
+// time, given as the number of inputs followed by the size of
+// every layer. Every loop bound is a constant, the pointers to
+// the weights are looked up once per evaluation, and the bias,
+// matmul and relu of each layer are done in a single pass using
+// the packed weights. The result is exactly the same as with
+// `nnet_evaluate`, which uses this for the shapes listed below.
+template<int... Sizes>
+struct nnet_static
+{
+    static constexpr int nlayers = sizeof...(Sizes) - 1;
+    static constexpr int sizes[sizeof...(Sizes)] = { Sizes... };
+
+    static_assert(nlayers > 0, "Network needs at least one layer");
+
+    // True if a loaded network has exactly these layer sizes
+    static bool matches(const nnet& nn)
+    {
+        if (nn.weights.size() != nlayers || nn.weights_packed.size() != nlayers)
+        {
+            return false;
+        }
+
+        for (int l = 0; l < nlayers; l++)
+        {
+            if (nn.weights[l].rows != sizes[l] ||
+                nn.weights[l].cols != sizes[l + 1] ||
+                nn.weights_packed[l].rows != nnet_kernel_npanels(sizes[l + 1]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Same as `nnet_evaluate`. The network must match.
+    static void evaluate(nnet_evaluation& evaluation, const nnet& nn)
+    {
+        assert(matches(nn) && evaluation.layers.size() == nlayers + 1);
+
+        float* layers[nlayers + 1];
+        const float* weights[nlayers];
+        const float* biases[nlayers];
+
+        for (int l = 0; l < nlayers; l++)
+        {
+            layers[l] = evaluation.layers[l].data;
+            weights[l] = nn.weights_packed[l].data;
+            biases[l] = nn.biases[l].data;
+        }
+        layers[nlayers] = evaluation.layers[nlayers].data;
+
+        if (!nn.folded)
+        {
+            for (int i = 0; i < sizes[0]; i++)
+            {
+                layers[0][i] = (layers[0][i] - nn.input_mean.data[i]) / nn.input_std.data[i];
+            }
+        }
+
+        nnet_kernel_dispatch([&](auto kernel)
+        {
+            evaluate_layers<decltype(kernel)>(
+                layers, weights, biases, std::make_integer_sequence<int, nlayers>());
+        });
+
+        if (!nn.folded)
+        {
+            for (int j = 0; j < sizes[nlayers]; j++)
+            {
+                layers[nlayers][j] = layers[nlayers][j] * nn.output_std.data[j] + nn.output_mean.data[j];
+            }
+        }
+    }
+
+private:
+
+    // No relu for final layer
+    template<typename K, int... L>
+    static inline void evaluate_layers(
+        float* const* layers,
+        const float* const* weights,
+        const float* const* biases,
+        std::integer_sequence<int, L...>)
+    {
+        (nnet_kernel_layer<K, L != nlayers - 1>(
+            layers[L + 1],
+            layers[L],
+            std::integral_constant<int, sizes[L]>(),
+            std::integral_constant<int, sizes[L + 1]>(),
+            weights[L],
+            biases[L]), ...);
+    }
+};
+
+//--------------------------------------
+
+// Shapes of the networks in `resources`, where the inputs of
+// the decompressor and stepper are 27 features and 32 latents
+
+typedef nnet_static<59, 512, 338> nnet_static_decompressor;
+typedef nnet_static<59, 512, 512, 59> nnet_static_stepper;
+typedef nnet_static<27, 512, 512, 512, 512, 59> nnet_static_projector;
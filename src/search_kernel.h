@@ -0,0 +1,423 @@
+#pragma once
+
+#include "mmpch.h"
+#include "database.h"
+#include "simd.h"
+
+//--------------------------------------
+
+// The kernels below compute the (squared) distance from the 
+// query either to a single feature vector or to an axis aligned
+// bounding box. They accumulate onto `cost` and may stop early
+// and return as soon as `cost >= best_cost`. The SIMD versions
+// process 8 features at a time and only check for early-out 
+// once each group of 8 has been accumulated which avoids the 
+// branch stopping the inner loop from being vectorized.
+//
+// `block_cost` instead uses the blocked layout to compute the 
+// cost of all BOUND_SM_SIZE frames in a small box at once, with 
+// one lane per frame, stopping early once every lane is worse 
+// than `best_cost`. Each lane accumulates features in the same 
+// order as the scalar `frame_cost` does.
+//
+// `quantized_cost` is the same as `frame_cost` but against a row
+// of the quantized features, which are converted back to float
+// using the per-dimension `offset` and `scale` as they are read.
+
+struct search_kernel_scalar
+{
+    static inline float frame_cost(
+        const float* RESTRICT query,
+        const float* RESTRICT frame,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        for (int j = 0; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - frame[j]);
+
+            if (cost >= best_cost)
+            {
+                break;
+            }
+        }
+
+        return cost;
+    }
+
+    static inline float box_cost(
+        const float* RESTRICT query,
+        const float* RESTRICT box_min,
+        const float* RESTRICT box_max,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        for (int j = 0; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - clampf(query[j], box_min[j], box_max[j]));
+
+            if (cost >= best_cost)
+            {
+                break;
+            }
+        }
+
+        return cost;
+    }
+
+    static inline void block_cost(
+        float* RESTRICT costs,
+        const float* RESTRICT query,
+        const float* RESTRICT block,
+        const int nfeatures,
+        const float transition_cost,
+        const float best_cost)
+    {
+        for (int k = 0; k < BOUND_SM_SIZE; k++)
+        {
+            costs[k] = transition_cost;
+        }
+
+        for (int j = 0; j < nfeatures; j += 8)
+        {
+            // Written so that the inner loop over frames 
+            // can be vectorized by the compiler
+            for (int jj = j; jj < j + 8; jj++)
+            {
+                for (int k = 0; k < BOUND_SM_SIZE; k++)
+                {
+                    costs[k] += squaref(query[jj] - block[jj * BOUND_SM_SIZE + k]);
+                }
+            }
+
+            bool live = false;
+            for (int k = 0; k < BOUND_SM_SIZE; k++)
+            {
+                live |= costs[k] < best_cost;
+            }
+
+            if (!live)
+            {
+                break;
+            }
+        }
+    }
+
+    static inline float quantized_cost(
+        const float* RESTRICT query,
+        const signed char* RESTRICT frame,
+        const float* RESTRICT offset,
+        const float* RESTRICT scale,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        for (int j = 0; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - (offset[j] + scale[j] * frame[j]));
+
+            if (cost >= best_cost)
+            {
+                break;
+            }
+        }
+
+        return cost;
+    }
+};
+
+#if defined(SIMD_X64)
+
+struct search_kernel_sse
+{
+    static inline float frame_cost(
+        const float* RESTRICT query,
+        const float* RESTRICT frame,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        int j = 0;
+        for (; j + 8 <= nfeatures; j += 8)
+        {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(query + j + 0), _mm_loadu_ps(frame + j + 0));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(query + j + 4), _mm_loadu_ps(frame + j + 4));
+            cost += simd_hsum_sse(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)));
+
+            if (cost >= best_cost)
+            {
+                return cost;
+            }
+        }
+
+        for (; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - frame[j]);
+        }
+
+        return cost;
+    }
+
+    static inline float box_cost(
+        const float* RESTRICT query,
+        const float* RESTRICT box_min,
+        const float* RESTRICT box_max,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        int j = 0;
+        for (; j + 8 <= nfeatures; j += 8)
+        {
+            __m128 q0 = _mm_loadu_ps(query + j + 0);
+            __m128 q1 = _mm_loadu_ps(query + j + 4);
+            __m128 d0 = _mm_sub_ps(q0, _mm_min_ps(_mm_max_ps(q0, _mm_loadu_ps(box_min + j + 0)), _mm_loadu_ps(box_max + j + 0)));
+            __m128 d1 = _mm_sub_ps(q1, _mm_min_ps(_mm_max_ps(q1, _mm_loadu_ps(box_min + j + 4)), _mm_loadu_ps(box_max + j + 4)));
+            cost += simd_hsum_sse(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)));
+
+            if (cost >= best_cost)
+            {
+                return cost;
+            }
+        }
+
+        for (; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - clampf(query[j], box_min[j], box_max[j]));
+        }
+
+        return cost;
+    }
+
+    static inline void block_cost(
+        float* RESTRICT costs,
+        const float* RESTRICT query,
+        const float* RESTRICT block,
+        const int nfeatures,
+        const float transition_cost,
+        const float best_cost)
+    {
+        __m128 best = _mm_set1_ps(best_cost);
+        __m128 c0 = _mm_set1_ps(transition_cost);
+        __m128 c1 = c0, c2 = c0, c3 = c0;
+
+        for (int j = 0; j < nfeatures; j += 8)
+        {
+            for (int jj = j; jj < j + 8; jj++)
+            {
+                __m128 q = _mm_set1_ps(query[jj]);
+                const float* RESTRICT row = block + jj * BOUND_SM_SIZE;
+                __m128 d0 = _mm_sub_ps(q, _mm_load_ps(row + 0));
+                __m128 d1 = _mm_sub_ps(q, _mm_load_ps(row + 4));
+                __m128 d2 = _mm_sub_ps(q, _mm_load_ps(row + 8));
+                __m128 d3 = _mm_sub_ps(q, _mm_load_ps(row + 12));
+                c0 = _mm_add_ps(c0, _mm_mul_ps(d0, d0));
+                c1 = _mm_add_ps(c1, _mm_mul_ps(d1, d1));
+                c2 = _mm_add_ps(c2, _mm_mul_ps(d2, d2));
+                c3 = _mm_add_ps(c3, _mm_mul_ps(d3, d3));
+            }
+
+            __m128 live = _mm_or_ps(
+                _mm_or_ps(_mm_cmplt_ps(c0, best), _mm_cmplt_ps(c1, best)),
+                _mm_or_ps(_mm_cmplt_ps(c2, best), _mm_cmplt_ps(c3, best)));
+
+            if (_mm_movemask_ps(live) == 0)
+            {
+                break;
+            }
+        }
+
+        _mm_storeu_ps(costs + 0, c0);
+        _mm_storeu_ps(costs + 4, c1);
+        _mm_storeu_ps(costs + 8, c2);
+        _mm_storeu_ps(costs + 12, c3);
+    }
+
+    static inline float quantized_cost(
+        const float* RESTRICT query,
+        const signed char* RESTRICT frame,
+        const float* RESTRICT offset,
+        const float* RESTRICT scale,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        int j = 0;
+        for (; j + 8 <= nfeatures; j += 8)
+        {
+            // Sign extend 8 bytes to 32-bit using only SSE2
+            __m128i b = _mm_loadl_epi64((const __m128i*)(frame + j));
+            __m128i w = _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8);
+            __m128 v0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16));
+            __m128 v1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16));
+            v0 = _mm_add_ps(_mm_loadu_ps(offset + j + 0), _mm_mul_ps(_mm_loadu_ps(scale + j + 0), v0));
+            v1 = _mm_add_ps(_mm_loadu_ps(offset + j + 4), _mm_mul_ps(_mm_loadu_ps(scale + j + 4), v1));
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(query + j + 0), v0);
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(query + j + 4), v1);
+            cost += simd_hsum_sse(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)));
+
+            if (cost >= best_cost)
+            {
+                return cost;
+            }
+        }
+
+        for (; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - (offset[j] + scale[j] * frame[j]));
+        }
+
+        return cost;
+    }
+};
+
+struct search_kernel_avx2
+{
+    SIMD_TARGET_AVX2 static inline float frame_cost(
+        const float* RESTRICT query,
+        const float* RESTRICT frame,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        int j = 0;
+        for (; j + 8 <= nfeatures; j += 8)
+        {
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(query + j), _mm256_loadu_ps(frame + j));
+            cost += simd_hsum_avx2(_mm256_mul_ps(d, d));
+
+            if (cost >= best_cost)
+            {
+                return cost;
+            }
+        }
+
+        if (j < nfeatures)
+        {
+            __m256i mask = simd_tail_mask_avx2(nfeatures - j);
+            __m256 d = _mm256_sub_ps(_mm256_maskload_ps(query + j, mask), _mm256_maskload_ps(frame + j, mask));
+            cost += simd_hsum_avx2(_mm256_mul_ps(d, d));
+        }
+
+        return cost;
+    }
+
+    SIMD_TARGET_AVX2 static inline float box_cost(
+        const float* RESTRICT query,
+        const float* RESTRICT box_min,
+        const float* RESTRICT box_max,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        int j = 0;
+        for (; j + 8 <= nfeatures; j += 8)
+        {
+            __m256 q = _mm256_loadu_ps(query + j);
+            __m256 d = _mm256_sub_ps(q, _mm256_min_ps(_mm256_max_ps(q, _mm256_loadu_ps(box_min + j)), _mm256_loadu_ps(box_max + j)));
+            cost += simd_hsum_avx2(_mm256_mul_ps(d, d));
+
+            if (cost >= best_cost)
+            {
+                return cost;
+            }
+        }
+
+        if (j < nfeatures)
+        {
+            __m256i mask = simd_tail_mask_avx2(nfeatures - j);
+            __m256 q = _mm256_maskload_ps(query + j, mask);
+            __m256 d = _mm256_sub_ps(q, _mm256_min_ps(_mm256_max_ps(q,
+                _mm256_maskload_ps(box_min + j, mask)), _mm256_maskload_ps(box_max + j, mask)));
+            cost += simd_hsum_avx2(_mm256_mul_ps(d, d));
+        }
+
+        return cost;
+    }
+
+    SIMD_TARGET_AVX2 static inline void block_cost(
+        float* RESTRICT costs,
+        const float* RESTRICT query,
+        const float* RESTRICT block,
+        const int nfeatures,
+        const float transition_cost,
+        const float best_cost)
+    {
+        __m256 best = _mm256_set1_ps(best_cost);
+        __m256 c0 = _mm256_set1_ps(transition_cost);
+        __m256 c1 = c0;
+
+        for (int j = 0; j < nfeatures; j += 8)
+        {
+            for (int jj = j; jj < j + 8; jj++)
+            {
+                __m256 q = _mm256_set1_ps(query[jj]);
+                __m256 d0 = _mm256_sub_ps(q, _mm256_load_ps(block + jj * BOUND_SM_SIZE + 0));
+                __m256 d1 = _mm256_sub_ps(q, _mm256_load_ps(block + jj * BOUND_SM_SIZE + 8));
+                c0 = _mm256_add_ps(c0, _mm256_mul_ps(d0, d0));
+                c1 = _mm256_add_ps(c1, _mm256_mul_ps(d1, d1));
+            }
+
+            __m256 live = _mm256_or_ps(
+                _mm256_cmp_ps(c0, best, _CMP_LT_OQ),
+                _mm256_cmp_ps(c1, best, _CMP_LT_OQ));
+
+            if (_mm256_movemask_ps(live) == 0)
+            {
+                break;
+            }
+        }
+
+        _mm256_storeu_ps(costs + 0, c0);
+        _mm256_storeu_ps(costs + 8, c1);
+    }
+
+    SIMD_TARGET_AVX2 static inline float quantized_cost(
+        const float* RESTRICT query,
+        const signed char* RESTRICT frame,
+        const float* RESTRICT offset,
+        const float* RESTRICT scale,
+        const int nfeatures,
+        float cost,
+        const float best_cost)
+    {
+        int j = 0;
+        for (; j + 8 <= nfeatures; j += 8)
+        {
+            __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(frame + j))));
+            v = _mm256_add_ps(_mm256_loadu_ps(offset + j), _mm256_mul_ps(_mm256_loadu_ps(scale + j), v));
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(query + j), v);
+            cost += simd_hsum_avx2(_mm256_mul_ps(d, d));
+
+            if (cost >= best_cost)
+            {
+                return cost;
+            }
+        }
+
+        for (; j < nfeatures; j++)
+        {
+            cost += squaref(query[j] - (offset[j] + scale[j] * frame[j]));
+        }
+
+        return cost;
+    }
+};
+
+#endif
+
+// Calls `f` with the kernel for the current instruction set
+template<typename F>
+static inline void search_kernel_dispatch(F&& f)
+{
+    switch (simd_get_level())
+    {
+#if defined(SIMD_X64)
+    case SIMD_AVX2: f(search_kernel_avx2()); break;
+    case SIMD_SSE: f(search_kernel_sse()); break;
+#endif
+    default: f(search_kernel_scalar()); break;
+    }
+}
@@ -0,0 +1,50 @@
+#include "mmpch.h"
+#include "simd.h"
+
+#if defined(SIMD_X64) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+simd_level simd_detect()
+{
+#if defined(SIMD_X64) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) { return SIMD_SSE; }
+
+	// AVX2 needs both the CPU flag and the OS to save
+	// the upper half of the ymm registers
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) { return SIMD_SSE; }
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0 ? SIMD_AVX2 : SIMD_SSE;
+#elif defined(SIMD_X64)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE;
+#elif defined(SIMD_NEON)
+	return SIMD_NEON;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+static int simd_level_current = -1;
+
+simd_level simd_get_level()
+{
+	if (simd_level_current == -1)
+	{
+		simd_level_current = simd_detect();
+	}
+
+	return (simd_level)simd_level_current;
+}
+
+void simd_set_level(const simd_level level)
+{
+	// Never go above what the CPU actually supports
+	simd_level_current = level < simd_detect() ? level : simd_detect();
+}
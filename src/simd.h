@@ -0,0 +1,71 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X64
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang need the instruction set to be enabled
+// per-function to be able to use AVX2 intrinsics without
+// compiling the whole program with -mavx2. MSVC always
+// allows them.
+#if defined(SIMD_X64) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SIMD_TARGET_AVX2
+#endif
+
+//--------------------------------------
+
+// Instruction sets which kernels can be dispatched to.
+// On x86-64 SSE is always available and AVX2 is picked
+// at runtime if the CPU supports it. On ARM NEON takes
+// the place of SSE. Everywhere else (e.g. the web build)
+// we use the scalar fallback.
+enum simd_level
+{
+    SIMD_SCALAR = 0,
+    SIMD_SSE    = 1,
+    SIMD_NEON   = 1,
+    SIMD_AVX2   = 2,
+};
+
+// Widest instruction set supported by this CPU
+simd_level simd_detect();
+
+// Instruction set currently used by the kernels. This
+// defaults to `simd_detect()` but can be lowered, for
+// example to compare against the scalar version.
+simd_level simd_get_level();
+void simd_set_level(const simd_level level);
+
+//--------------------------------------
+
+#if defined(SIMD_X64)
+
+static inline float simd_hsum_sse(const __m128 x)
+{
+    __m128 s = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55));
+    return _mm_cvtss_f32(s);
+}
+
+SIMD_TARGET_AVX2 static inline float simd_hsum_avx2(const __m256 x)
+{
+    return simd_hsum_sse(_mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)));
+}
+
+// Mask for loading the first `count` (0 to 8)
+// elements of a 8-wide vector
+SIMD_TARGET_AVX2 static inline __m256i simd_tail_mask_avx2(const int count)
+{
+    static const int mask_table[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+    return _mm256_loadu_si256((const __m256i*)(mask_table + 8 - count));
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "mmpch.h"
+#include "thread_pool.h"
+
+static void thread_pool_work(thread_pool& pool, const std::function<void(int, int)>& func, int thread)
+{
+	while (true)
+	{
+		int task = pool.task_next.fetch_add(1);
+
+		if (task >= pool.task_count)
+		{
+			break;
+		}
+
+		func(task, thread);
+	}
+}
+
+static void thread_pool_worker(thread_pool& pool, int thread, int generation)
+{
+	while (true)
+	{
+		const std::function<void(int, int)>* job;
+
+		{
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.start_signal.wait(lock, [&] { return pool.quit || pool.generation != generation; });
+
+			if (pool.quit)
+			{
+				return;
+			}
+
+			generation = pool.generation;
+			job = pool.job;
+		}
+
+		thread_pool_work(pool, *job, thread);
+
+		{
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.workers_running--;
+		}
+
+		pool.done_signal.notify_one();
+	}
+}
+
+thread_pool::~thread_pool()
+{
+	thread_pool_resize(*this, 1);
+}
+
+void thread_pool_resize(thread_pool& pool, int nthreads)
+{
+#if defined(PLATFORM_WEB)
+	// Web build is compiled without thread support
+	nthreads = 1;
+#endif
+
+	nthreads = nthreads < 1 ? 1 : nthreads;
+
+	if (nthreads == pool.nthreads())
+	{
+		return;
+	}
+
+	// Stop all existing workers
+	{
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		pool.quit = true;
+	}
+
+	pool.start_signal.notify_all();
+
+	for (int i = 0; i < (int)pool.workers.size(); i++)
+	{
+		pool.workers[i].join();
+	}
+
+	pool.workers.clear();
+	pool.quit = false;
+
+	// Start new ones
+	for (int i = 1; i < nthreads; i++)
+	{
+		pool.workers.emplace_back(thread_pool_worker, std::ref(pool), i, pool.generation);
+	}
+}
+
+void thread_pool_run(
+	thread_pool& pool,
+	const int ntasks,
+	const std::function<void(int, int)>& func)
+{
+	if (pool.workers.empty() || ntasks <= 1)
+	{
+		for (int i = 0; i < ntasks; i++)
+		{
+			func(i, 0);
+		}
+
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		pool.job = &func;
+		pool.task_count = ntasks;
+		pool.task_next = 0;
+		pool.workers_running = (int)pool.workers.size();
+		pool.generation++;
+	}
+
+	pool.start_signal.notify_all();
+
+	// Calling thread takes part in the work too
+	thread_pool_work(pool, func, 0);
+
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.done_signal.wait(lock, [&] { return pool.workers_running == 0; });
+	pool.job = nullptr;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+//--------------------------------------
+
+// Very basic pool of persistent worker threads used to
+// run a number of independent tasks in parallel. The
+// calling thread also takes part in the work so a pool
+// of a single thread just runs everything serially.
+struct thread_pool
+{
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_signal;
+    std::condition_variable done_signal;
+
+    // Current job, tasks are handed out using `task_next`
+    const std::function<void(int, int)>* job = nullptr;
+    std::atomic<int> task_next{0};
+    int task_count = 0;
+    int workers_running = 0;
+    int generation = 0;
+    bool quit = false;
+
+    int nthreads() const { return (int)workers.size() + 1; }
+
+    ~thread_pool();
+};
+
+// Set the total number of threads (including the calling
+// thread). Anything less than two means tasks are run
+// serially on the calling thread.
+void thread_pool_resize(thread_pool& pool, int nthreads);
+
+// Runs `func(task, thread)` for every task in [0, ntasks)
+// and waits for all of them to finish. `thread` is in the
+// range [0, pool.nthreads()) and can be used to index
+// per-thread scratch storage.
+void thread_pool_run(
+    thread_pool& pool,
+    const int ntasks,
+    const std::function<void(int, int)>& func);